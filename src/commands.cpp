@@ -19,54 +19,909 @@
 // DEALINGS IN THE SOFTWARE.
 //
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <queue>
+
+#include <sys/stat.h>
 
 #include "commands.h"
 #include "configuration/configuration.h"
+#include "services/downloadjournal.h"
+#include "services/filewriter.h"
+#include "services/http.h"
 #include "services/tfsproxy.h"
 #include "utils/filesys.h"
+#include "utils/logging.h"
+#include "utils/md5.h"
+
+// The downloads as they were queued, to compare the run with its schedule.
+struct schedule_stats {
+  std::vector<int64_t> sizes;   // in the order they were queued.
+  size_t large_queued;          // taken from the large end, not finished.
+  double started;
+  // Least squares fit of download time = latency + size / rate.
+  double n, sx, sy, sxx, sxy;
+};
+
+// The clone runs as a pipeline: listings produce files to fetch, which wait
+// in the schedule queue (parallel listing only) until the fetch queue of the
+// executor has room. Fetched data goes through the executor's write queue to
+// a writer thread. Every queue is bounded, so a slow stage holds back the
+// ones before it instead of piling up data.
+//
+// Where the listing tells file sizes, the largest files are started first,
+// so that they do not end up holding up the finish. Only up to half of the
+// fetch queue goes to them though, the rest keeps busy with the smallest
+// files.
+struct clone_context {
+  const TfsProxy& tfs;
+  std::string project;
+  http::HttpExecutor& executor;
+  DownloadJournal& journal;
+  size_t max_queued;    // fetch queue: downloads queued or in flight.
+  size_t max_scheduled; // schedule queue: files listed but not queued.
+  size_t peak_queued;
+  size_t peak_scheduled;
+  unsigned long up_to_date; // files left alone, their content matched.
+  std::vector<DownloadResult> failures;
+  schedule_stats schedule;
+};
+
+static double now_seconds()
+{
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string last_path_segment(const std::string& path)
+{
+  std::string::size_type last_slash = path.rfind('/');
+  if (last_slash != std::string::npos) {
+    return path.substr(last_slash + 1);
+  }
+  return std::string();
+}
+
+// Wait until the fetch queue has room, which keeps the number of queued
+// downloads (and open files) bounded.
+static void wait_for_room(clone_context& ctx)
+{
+  ctx.executor.drain(ctx.max_queued - 1);
+}
+
+// Whether the next download should be the largest file waiting, rather
+// than the smallest.
+static bool next_is_large(const clone_context& ctx)
+{
+  return ctx.schedule.large_queued < std::max<size_t>(1, ctx.max_queued / 2);
+}
+
+// Whether the file at local_path already holds the listed content (md5 is
+// the digest from the listing, empty if there was none), as it does when a
+// clone runs again into the same directory.
+static bool is_up_to_date(const std::string& local_path, int64_t size,
+    const std::string& md5)
+{
+  struct stat st;
+
+  if (md5.empty() || stat(local_path.c_str(), &st) != 0 ||
+      (int64_t)st.st_size != size)
+    return false;
+  return utils::Md5File(local_path) == md5;
+}
+
+static void queue_download(clone_context& ctx, const std::string& path,
+    int version, int64_t size, const std::string& md5,
+    const std::string& local_path, bool large = false)
+{
+  if (is_up_to_date(local_path, size, md5)) {
+    printf("Up to date: %s\n", path.c_str());
+    ctx.up_to_date++;
+    return;
+  }
+
+  printf("Getting: %s\n", path.c_str());
+
+  wait_for_room(ctx);
+  schedule_stats& schedule = ctx.schedule;
+  if (schedule.sizes.empty())
+    schedule.started = now_seconds();
+  schedule.sizes.push_back(size);
+  if (large)
+    schedule.large_queued++;
+
+  ctx.tfs.QueueDirectFile(ctx.tfs.ItemUrl(path, version), local_path, version,
+      ctx.journal, [&ctx, size, large](const DownloadResult& result) {
+        schedule_stats& schedule = ctx.schedule;
+        if (large)
+          schedule.large_queued--;
+        if (!result.Success) {
+          ctx.failures.push_back(result);
+          return;
+        }
+        schedule.n++;
+        schedule.sx += size;
+        schedule.sy += result.Seconds;
+        schedule.sxx += (double)size * size;
+        schedule.sxy += size * result.Seconds;
+      }, ctx.executor);
+
+  if (ctx.executor.pending() > ctx.peak_queued)
+    ctx.peak_queued = ctx.executor.pending();
+}
 
-static void get_contents(const TfsProxy& tfs, const std::string& project, const std::string& path)
+// Lists one folder per request while walking the tree.
+static void get_contents(clone_context& ctx, const std::string& path,
+    const std::string& local_dir)
 {
-  auto files = tfs.GetPathInfo(project, path);
+  auto files = ctx.tfs.GetPathInfo(ctx.project, path);
   for (const auto& file : files) {
+    std::string local_path = filesys::join_path(local_dir,
+        last_path_segment(file.Path));
 
     if (!file.IsFolder) {
-      printf("Getting: %s\n", file.Path.c_str());
-      tfs.GetDirectFile(file.Url);
+      queue_download(ctx, file.Path, file.Version, file.Size,
+          utils::DecodeMd5Hash(file.HashValue), local_path);
       continue;
     }
 
-    std::string::size_type last_slash = file.Path.rfind('/');
-    std::string dir_name;
-    if (last_slash != std::string::npos) {
-      dir_name = file.Path.substr(last_slash + 1);
+    filesys::create_dir(local_path);
+    get_contents(ctx, file.Path, local_path);
+  }
+}
+
+// Local path of a node, relative to the root of the tree.
+static std::string tree_local_path(const TfTree& tree, TfTree::Index node)
+{
+  TfTree::Index parent = tree.Parent(node);
+  if (parent == tree.Root())
+    return tree.Name(node);
+  return filesys::join_path(tree_local_path(tree, parent), tree.Name(node));
+}
+
+// Creates the folders of a tree that was listed up front, then downloads
+// its files from both ends of the size order.
+static void get_tree_contents(clone_context& ctx, const TfTree& tree)
+{
+  std::vector<TfTree::Index> files;
+
+  // Folders come before their contents.
+  for (TfTree::Index node = 1; node < tree.Size(); node++) {
+    if (tree.IsFolder(node))
+      filesys::create_dir(tree_local_path(tree, node));
+    else
+      files.push_back(node);
+  }
+
+  std::stable_sort(files.begin(), files.end(),
+      [&tree](TfTree::Index a, TfTree::Index b) {
+        return tree.Bytes(a) > tree.Bytes(b);
+      });
+
+  size_t largest = 0;
+  size_t smallest = files.size();
+  while (largest < smallest) {
+    wait_for_room(ctx);
+    bool large = next_is_large(ctx);
+    TfTree::Index node = large ? files[largest++] : files[--smallest];
+    queue_download(ctx, tree.Path(node), tree.Version(node),
+        tree.Bytes(node), tree.Md5(node), tree_local_path(tree, node), large);
+  }
+}
+
+// Full listings larger than this are aborted and split up.
+static const long max_full_listing_bytes = 64L * 1024 * 1024;
+
+// A folder waiting to be listed by the parallel traversal.
+struct listing_task {
+  std::string path;
+  std::string local_dir;
+  bool full;
+};
+
+// A file listed by the parallel traversal, waiting to be downloaded.
+struct scheduled_file {
+  std::string path;
+  int version;
+  int64_t size;
+  std::string md5;
+  std::string local_path;
+};
+
+// The files of a finished listing, moved to the schedule queue a few at a
+// time as it has room: either the nodes of a full listing's tree, or the
+// items of a one level listing.
+struct listed_files {
+  TfTree tree;
+  std::vector<TfFileInfo> items;
+  std::string local_dir;  // of the listed folder.
+  size_t next;            // next node or item to look at.
+};
+
+// State of the parallel traversal. Folder listings run concurrently on the
+// executor; their callbacks only record results, which the loop in
+// get_contents_parallel() then acts on.
+struct traversal {
+  std::deque<listing_task> frontier;
+  std::deque<listed_files> listed;
+  std::multimap<int64_t, scheduled_file> files;  // by size.
+  size_t in_flight;
+  long timeout;
+  unsigned long listings;
+  unsigned long splits;
+};
+
+static void start_listing(clone_context& ctx, traversal& walk,
+    const listing_task& task)
+{
+  ListingOptions options;
+  options.Full = task.full;
+  options.Timeout = task.full ? walk.timeout : 0;
+  options.MaxBytes = task.full ? max_full_listing_bytes : 0;
+
+  walk.in_flight++;
+  walk.listings++;
+  ctx.tfs.QueuePathInfo(ctx.project, task.path, options,
+      [&walk, task](ListingResult& result) {
+        walk.in_flight--;
+
+        if (!result.Success && task.full) {
+          // Too slow or too large for one request: list this folder alone
+          // and try its subfolders as separate subtrees.
+          log_tmsg(0, "Full listing of %s failed (%s), splitting it up",
+              task.path.c_str(), result.Error.c_str());
+          walk.splits++;
+          walk.frontier.push_back({ task.path, task.local_dir, false });
+          return;
+        }
+        if (!result.Success) {
+          fprintf(stderr, "Failed to list %s (%s)\n", task.path.c_str(),
+              result.Error.c_str());
+          return;
+        }
+
+        walk.listed.push_back(listed_files());
+        listed_files& listed = walk.listed.back();
+        listed.local_dir = task.local_dir;
+        listed.next = 0;
+        if (task.full) {
+          listed.tree = std::move(result.Tree);
+          return;
+        }
+
+        // The subfolders are listed right away, only files wait.
+        for (auto& item : result.Items) {
+          if (!item.IsFolder) {
+            listed.items.push_back(std::move(item));
+            continue;
+          }
+          std::string local_path = filesys::join_path(task.local_dir,
+              last_path_segment(item.Path));
+          filesys::create_dir(local_path);
+          walk.frontier.push_back({ item.Path, local_path, true });
+        }
+      }, ctx.executor);
+}
+
+// Moves the next file of a finished listing to the schedule queue, creating
+// the folders of a full listing on the way. Returns false once the listing
+// has no files left.
+static bool schedule_next(traversal& walk, listed_files& listed)
+{
+  if (listed.tree.Empty()) {
+    if (listed.next == listed.items.size())
+      return false;
+    const TfFileInfo& item = listed.items[listed.next++];
+    walk.files.insert(std::make_pair(item.Size, scheduled_file{
+        item.Path, item.Version, item.Size,
+        utils::DecodeMd5Hash(item.HashValue),
+        filesys::join_path(listed.local_dir, last_path_segment(item.Path)) }));
+    return true;
+  }
+
+  // Folders come before their contents, the root is there already.
+  const TfTree& tree = listed.tree;
+  if (listed.next == 0)
+    listed.next = 1;
+  while (listed.next < tree.Size()) {
+    TfTree::Index node = listed.next++;
+    std::string local_path = filesys::join_path(listed.local_dir,
+        tree_local_path(tree, node));
+    if (tree.IsFolder(node)) {
+      filesys::create_dir(local_path);
+      continue;
+    }
+    walk.files.insert(std::make_pair(tree.Bytes(node), scheduled_file{
+        tree.Path(node), tree.Version(node), tree.Bytes(node),
+        tree.Md5(node), local_path }));
+    return true;
+  }
+  return false;
+}
+
+// Lists folders concurrently, starting with a full listing of the whole
+// path. A full listing that fails (typically by timing out or growing too
+// large) is split into a one level listing of its folder and full listings
+// of each subfolder. Listings are taken depth first from the frontier so
+// that it stays small.
+static void get_contents_parallel(clone_context& ctx, const std::string& path,
+    long timeout, bool show_stats)
+{
+  traversal walk;
+  walk.in_flight = 0;
+  walk.timeout = timeout;
+  walk.listings = 0;
+  walk.splits = 0;
+  walk.frontier.push_back({ path, std::string(), true });
+
+  size_t max_listings = (size_t)ctx.executor.max_transfers();
+
+  for (;;) {
+    // The schedule queue is bounded in files, whole listings wait outside
+    // of it until it has room.
+    while (!walk.listed.empty() && walk.files.size() < ctx.max_scheduled) {
+      if (!schedule_next(walk, walk.listed.front()))
+        walk.listed.pop_front();
+    }
+
+    // Listing stops while the files listed so far do not fit.
+    while (!walk.frontier.empty() && walk.in_flight < max_listings &&
+        walk.listed.empty() && walk.files.size() < ctx.max_scheduled) {
+      listing_task task = walk.frontier.back();
+      walk.frontier.pop_back();
+      start_listing(ctx, walk, task);
+    }
+
+    if (walk.files.size() > ctx.peak_scheduled)
+      ctx.peak_scheduled = walk.files.size();
+
+    if (!walk.files.empty()) {
+      // May wait for queued transfers, listings included, to finish.
+      wait_for_room(ctx);
+      bool large = next_is_large(ctx);
+      auto next = large ? std::prev(walk.files.end()) : walk.files.begin();
+      scheduled_file file = next->second;
+      walk.files.erase(next);
+      queue_download(ctx, file.path, file.version, file.size, file.md5,
+          file.local_path, large);
+      continue;
     }
-    filesys::create_dir_then_change(dir_name);
-    get_contents(tfs, project, file.Path);
-    filesys::go_up();
+
+    if (walk.frontier.empty() && walk.in_flight == 0)
+      break;
+    ctx.executor.poll();
+  }
+
+  if (show_stats) {
+    fprintf(stderr, "Folder listings: %lu, split up: %lu\n", walk.listings,
+        walk.splits);
+  }
+}
+
+static bool parse_option(const std::vector<std::string>& args, size_t& i,
+    const char *short_name, const char *long_name, std::string& value)
+{
+  const std::string& arg = args[i];
+  std::string long_eq = std::string(long_name) + "=";
+
+  if (arg.compare(0, long_eq.size(), long_eq) == 0) {
+    value = arg.substr(long_eq.size());
+    return true;
+  }
+  if (arg == short_name || arg == long_name) {
+    if (i + 1 < args.size()) {
+      value = args[++i];
+    }
+    return true;
   }
+  return false;
 }
 
+static bool parse_int_option(const std::vector<std::string>& args, size_t& i,
+    const char *short_name, const char *long_name, int& value)
+{
+  std::string str;
+
+  if (!parse_option(args, i, short_name, long_name, str))
+    return false;
+  if (!str.empty())
+    value = atoi(str.c_str());
+  return true;
+}
+
+static bool configure_auth(TfsProxy& tfs)
+{
+  std::string auth = AppConfig.Get("tfs", "auth");
+  http::AuthScheme scheme;
+
+  if (!http::parse_auth_scheme(auth, scheme)) {
+    fprintf(stderr, "Unknown auth scheme '%s', expected one of: ntlm, "
+        "basic, pat, negotiate\n", auth.c_str());
+    return false;
+  }
+  tfs.SetAuthScheme(scheme);
+  return true;
+}
+
+// Applies the [http] section of the configuration to the executor.
+static void configure_executor(http::HttpExecutor& executor)
+{
+  std::string event_loop = AppConfig.Get("http", "event_loop");
+  std::string http2 = AppConfig.Get("http", "http2");
+  std::string compression = AppConfig.Get("http", "compression");
+  std::string adaptive = AppConfig.Get("http", "adaptive");
+  std::string stall_timeout = AppConfig.Get("http", "stall_timeout");
+  std::string hedge = AppConfig.Get("http", "hedge");
+  std::string decode_threads = AppConfig.Get("http", "decode_threads");
+
+  if (event_loop == "epoll" && !executor.set_event_loop(true)) {
+    fprintf(stderr, "The epoll event loop is not available, falling back "
+        "to curl_multi_wait\n");
+  }
+
+  if (http2 == "yes" || http2 == "true" || http2 == "1") {
+    std::string max_streams = AppConfig.Get("http", "max_streams");
+    executor.set_multiplex(true, atol(max_streams.c_str()));
+  }
+
+  if (compression == "no" || compression == "false" || compression == "0") {
+    executor.set_compression(false);
+  }
+
+  if (adaptive == "yes" || adaptive == "true" || adaptive == "1") {
+    executor.set_adaptive(true);
+  }
+
+  if (!stall_timeout.empty()) {
+    executor.set_stall_timeout(atol(stall_timeout.c_str()));
+  }
+
+  if (hedge == "yes" || hedge == "true" || hedge == "1") {
+    std::string percentile = AppConfig.Get("http", "hedge_percentile");
+    double p = percentile.empty() ? 95 : atof(percentile.c_str());
+    if (p > 0 && p < 100) {
+      executor.set_hedging(true, p / 100);
+    }
+  }
+
+  executor.set_decode_threads(decode_threads.empty() ? 2 :
+      atoi(decode_threads.c_str()));
+}
+
+static void print_http_stats(const http::HttpStats& stats)
+{
+  fprintf(stderr, "HTTP requests: %lu, new connections: %lu\n",
+      stats.requests, stats.connects);
+  fprintf(stderr, "Auth handshakes: %lu (%lu challenges), requests on "
+      "authenticated connections: %lu\n", stats.auth_handshakes,
+      stats.auth_round_trips, stats.auth_reused);
+  fprintf(stderr, "Response bytes: %lld received, %lld decoded\n",
+      (long long)stats.wire_bytes, (long long)stats.body_bytes);
+  fprintf(stderr, "Throttled responses: %lu, stalls: %lu, retries: %lu\n",
+      stats.throttled, stats.stalls, stats.retries);
+  fprintf(stderr, "Hedged requests: %lu, won by the hedge: %lu\n",
+      stats.hedges, stats.hedge_wins);
+}
+
+// Peak depth of each pipeline queue against its limit, for tuning the
+// [pipeline] settings.
+static void print_pipeline_stats(const clone_context& ctx)
+{
+  http::FileWriter *writer = ctx.executor.file_writer();
+
+  if (ctx.up_to_date > 0)
+    fprintf(stderr, "Up to date, not downloaded: %lu files\n", ctx.up_to_date);
+  fprintf(stderr, "Queue peaks: schedule %zu/%zu, fetch %zu/%zu",
+      ctx.peak_scheduled, ctx.max_scheduled, ctx.peak_queued, ctx.max_queued);
+  if (writer != NULL) {
+    fprintf(stderr, ", write %zu/%zu KB (%lu pauses)",
+        writer->peak_bytes() / 1024, writer->max_bytes() / 1024,
+        ctx.executor.stats().write_pauses);
+  }
+  fprintf(stderr, "\n");
+}
+
+// Compares the time the downloads took with the time their schedule would
+// take on max_transfers connections, if every download took the latency
+// plus size / rate fitted to the downloads of this run.
+static void print_schedule_stats(const clone_context& ctx, double finished)
+{
+  const schedule_stats& schedule = ctx.schedule;
+  if (schedule.n < 1)
+    return;
+
+  double per_byte = 0;
+  double denominator = schedule.n * schedule.sxx - schedule.sx * schedule.sx;
+  if (schedule.n > 1 && denominator > 0) {
+    per_byte = (schedule.n * schedule.sxy - schedule.sx * schedule.sy) /
+      denominator;
+    per_byte = std::max(per_byte, 0.0);
+  }
+  double latency = std::max((schedule.sy - per_byte * schedule.sx) /
+      schedule.n, 0.0);
+
+  // Each download goes to the connection that frees up first.
+  std::priority_queue<double, std::vector<double>, std::greater<double> >
+    connections;
+  for (int i = 0; i < ctx.executor.max_transfers(); i++)
+    connections.push(0);
+  double predicted = 0;
+  long long bytes = 0;
+  for (int64_t size : schedule.sizes) {
+    double done = connections.top() + latency + per_byte * size;
+    connections.pop();
+    connections.push(done);
+    predicted = std::max(predicted, done);
+    bytes += size;
+  }
+
+  fprintf(stderr, "Schedule: %zu files, %lld bytes, predicted %.2fs, took "
+      "%.2fs (latency %.0f ms", schedule.sizes.size(), bytes, predicted,
+      finished - schedule.started, latency * 1000);
+  if (per_byte > 0)
+    fprintf(stderr, ", %.0f KB/s per transfer", 1 / per_byte / 1024);
+  fprintf(stderr, ")\n");
+}
+
+static size_t config_size(const char *section, const char *key,
+    size_t default_value)
+{
+  std::string value = AppConfig.Get(section, key);
+  if (value.empty())
+    return default_value;
+  return (size_t)atol(value.c_str());
+}
+
+// Kept in the directory the clone writes to, until a clone completes
+// without failed downloads.
+static const char clone_journal[] = ".tfpartial";
+
 static void cmd_clone(const std::vector<std::string>& args)
 {
-  if (args.size() < 1) {
-    fprintf(stderr, "You must specify an argument: tf clone $/Folder1/Folder2/File.cs\n");
+  std::vector<std::string> positional;
+  int jobs = 1;
+  int prewarm = -1;
+  bool show_stats = false;
+  std::string listing = "onelevel";
+  int listing_timeout = 30;
+
+  for (size_t i = 0; i < args.size(); i++) {
+    if (parse_int_option(args, i, "-j", "--jobs", jobs))
+      continue;
+    if (parse_int_option(args, i, "--prewarm", "--prewarm", prewarm))
+      continue;
+    if (parse_option(args, i, "--listing", "--listing", listing))
+      continue;
+    if (parse_int_option(args, i, "--listing-timeout", "--listing-timeout",
+        listing_timeout))
+      continue;
+    if (args[i] == "--stats") {
+      show_stats = true;
+      continue;
+    }
+    positional.push_back(args[i]);
+  }
+
+  if (positional.size() < 1 || jobs < 1 ||
+      (listing != "onelevel" && listing != "full" && listing != "parallel")) {
+    fprintf(stderr, "You must specify an argument: tf clone [--jobs N] [--prewarm N] [--listing onelevel|full|parallel] [--listing-timeout N] [--stats] $/Folder1/Folder2/File.cs\n");
     return;
   }
 
   // Assume the first argument is the path we want to get, we will recursively
   // iterate through that tree and fetch each file.
-  const std::string& path = args[0];
+  const std::string& path = positional[0];
   std::string dest;
-  if (args.size() > 1) {
-    dest = args[1];
+  if (positional.size() > 1) {
+    dest = positional[1];
+  }
+  TfsProxy tfs(AppConfig.Get("tfs", "base_url"), "unused",
+      AppConfig.Get("tfs", "username"), AppConfig.Get("tfs", "password"));
+  if (!configure_auth(tfs))
+    return;
+
+  http::HttpExecutor& executor = http::HttpExecutor::default_instance();
+  executor.set_max_transfers(jobs);
+  configure_executor(executor);
+
+  // Partial files left by an earlier run, see QueueDirectFile().
+  DownloadJournal journal;
+  if (!journal.Open(clone_journal)) {
+    fprintf(stderr, "Unable to open %s: %s\n", clone_journal,
+        strerror(errno));
+    return;
+  }
+
+  clone_context ctx = { tfs, AppConfig.Get("tfs", "default_project"),
+    executor, journal, config_size("pipeline", "fetch_queue", (size_t)jobs * 2),
+    config_size("pipeline", "schedule_queue", 1024), 0, 0, 0, {} };
+  if (ctx.max_queued < 1)
+    ctx.max_queued = 1;
+  if (ctx.max_scheduled < 1)
+    ctx.max_scheduled = 1;
+  executor.set_write_queue(config_size("pipeline", "write_queue_mb", 8) *
+      1024 * 1024);
+
+  // Get the connections for the first downloads ready while the first
+  // listing is still running.
+  if (prewarm < 0)
+    prewarm = jobs > 1 ? jobs : 0;
+  tfs.Prewarm(prewarm, executor);
+
+  TfTree tree;
+  if (listing == "full") {
+    if (tfs.GetTree(ctx.project, path, tree)) {
+      get_tree_contents(ctx, tree);
+    } else {
+      fprintf(stderr, "Recursive listing of %s failed, listing one folder "
+          "at a time\n", path.c_str());
+      listing = "onelevel";
+    }
+  }
+  if (listing == "parallel")
+    get_contents_parallel(ctx, path, listing_timeout, show_stats);
+  if (listing == "onelevel")
+    get_contents(ctx, path, std::string());
+  executor.run();
+  double finished = now_seconds();
+
+  for (const auto& failure : ctx.failures) {
+    fprintf(stderr, "Failed: %s (%s)\n", failure.LocalPath.c_str(),
+        failure.Error.c_str());
+  }
+  if (ctx.failures.empty())
+    journal.Remove();
+
+  if (show_stats) {
+    print_http_stats(executor.stats());
+    print_pipeline_stats(ctx);
+    print_schedule_stats(ctx, finished);
+  }
+}
+
+// One line per item: version, kind, size and path.
+static void print_item(const TfFileInfo& item)
+{
+  printf("%8d %s %12lld %s\n", item.Version,
+      item.IsFolder ? "folder" : "file  ", (long long)item.Size,
+      item.Path.c_str());
+}
+
+// Prints the version and size of every given path, resolved with batched
+// requests, --jobs of them at a time. A path of "-" reads further paths
+// from standard input, one per line.
+static void cmd_stat(const std::vector<std::string>& args)
+{
+  std::vector<std::string> paths;
+  int version = 0;
+  int jobs = 4;
+
+  for (size_t i = 0; i < args.size(); i++) {
+    if (parse_int_option(args, i, "-v", "--version", version))
+      continue;
+    if (parse_int_option(args, i, "-j", "--jobs", jobs))
+      continue;
+    if (args[i] == "-") {
+      char line[4096];
+      while (fgets(line, sizeof(line), stdin) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0')
+          paths.push_back(line);
+      }
+      continue;
+    }
+    paths.push_back(args[i]);
+  }
+
+  if (paths.empty() || jobs < 1) {
+    fprintf(stderr, "You must specify an argument: tf stat [--version N] [--jobs N] $/Folder1/File.cs... | -\n");
+    return;
+  }
+
+  TfsProxy tfs(AppConfig.Get("tfs", "base_url"), "unused",
+      AppConfig.Get("tfs", "username"), AppConfig.Get("tfs", "password"));
+  if (!configure_auth(tfs))
+    return;
+  http::HttpExecutor& executor = http::HttpExecutor::default_instance();
+  executor.set_max_transfers(jobs);
+  configure_executor(executor);
+
+  std::vector<TfFileInfo> items;
+  if (!tfs.GetItemsBatch(AppConfig.Get("tfs", "default_project"), paths,
+      version, items)) {
+    fprintf(stderr, "Unable to get all items\n");
+  }
+
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (items[i].Path.empty()) {
+      fprintf(stderr, "%s: not found\n", paths[i].c_str());
+      continue;
+    }
+    print_item(items[i]);
+  }
+}
+
+// Lists the items in a folder, or everything below it with -R, as the
+// listing is decoded. Nothing is downloaded.
+static void cmd_ls(const std::vector<std::string>& args)
+{
+  std::string path;
+  bool recursive = false;
+
+  for (size_t i = 0; i < args.size(); i++) {
+    if (args[i] == "-R" || args[i] == "--recursive") {
+      recursive = true;
+      continue;
+    }
+    path = args[i];
+  }
+
+  if (path.empty()) {
+    fprintf(stderr, "You must specify an argument: tf ls [-R] $/Folder1\n");
+    return;
   }
+
   TfsProxy tfs(AppConfig.Get("tfs", "base_url"), "unused",
       AppConfig.Get("tfs", "username"), AppConfig.Get("tfs", "password"));
-  std::string project = AppConfig.Get("tfs", "default_project");
+  if (!configure_auth(tfs))
+    return;
+  configure_executor(http::HttpExecutor::default_instance());
+
+  // The listing of a file is the file itself, that of a folder starts with
+  // the folder.
+  bool first = true;
+  if (!tfs.ListItems(AppConfig.Get("tfs", "default_project"), path,
+      recursive, [&first](const TfFileInfo& item) {
+    bool skip = first && item.IsFolder;
+    first = false;
+    if (!skip)
+      print_item(item);
+  })) {
+    fprintf(stderr, "Unable to list %s\n", path.c_str());
+  }
+}
+
+// Totals of a folder in a du listing.
+struct folder_usage {
+  int64_t bytes;
+  unsigned long files;
+};
+
+// Prints the usage of the folders below node, deepest first, and returns
+// that of node.
+static folder_usage print_usage(const TfTree& tree, TfTree::Index node,
+    const std::string& path, bool summary)
+{
+  folder_usage usage = { 0, 0 };
+
+  for (TfTree::Index child = tree.FirstChild(node);
+      child < tree.EndChild(node); child++) {
+    if (tree.IsFolder(child)) {
+      folder_usage sub = print_usage(tree, child, path + "/" +
+          tree.Name(child), summary);
+      usage.bytes += sub.bytes;
+      usage.files += sub.files;
+    } else {
+      usage.bytes += tree.Bytes(child);
+      usage.files++;
+    }
+  }
 
-  get_contents(tfs, project, path);
+  if (!summary || node == tree.Root()) {
+    printf("%12lld %8lu %s\n", (long long)usage.bytes, usage.files,
+        path.c_str());
+  }
+  return usage;
+}
+
+// Prints the bytes and number of files below every folder of a path, from
+// a single recursive listing. Nothing is downloaded. -s prints the path
+// only. Paths are spelled the way the server does, whatever the case typed.
+static void cmd_du(const std::vector<std::string>& args)
+{
+  std::string path;
+  bool summary = false;
+
+  for (size_t i = 0; i < args.size(); i++) {
+    if (args[i] == "-s" || args[i] == "--summarize") {
+      summary = true;
+      continue;
+    }
+    path = args[i];
+  }
+
+  if (path.empty()) {
+    fprintf(stderr, "You must specify an argument: tf du [-s] $/Folder1\n");
+    return;
+  }
+
+  TfsProxy tfs(AppConfig.Get("tfs", "base_url"), "unused",
+      AppConfig.Get("tfs", "username"), AppConfig.Get("tfs", "password"));
+  if (!configure_auth(tfs))
+    return;
+  configure_executor(http::HttpExecutor::default_instance());
+
+  // The tree matches the root without regard to case, so the listing of
+  // $/proj/root still fills in $/Proj/Root.
+  TfTree tree;
+  tree.Begin(path);
+  if (!tfs.ListItems(AppConfig.Get("tfs", "default_project"), path, true,
+      [&tree](const TfFileInfo& item) {
+    tree.Add(item.Path, item.Version, item.IsFolder, item.Size);
+  }) || !tree.Finish()) {
+    fprintf(stderr, "Unable to list %s\n", path.c_str());
+    return;
+  }
+
+  print_usage(tree, tree.Root(), tree.Path(tree.Root()), summary);
+}
+
+// Prints the changesets of a path, oldest first, from --from N on (the
+// first by default). --changes lists the changed items of each.
+static void cmd_history(const std::vector<std::string>& args)
+{
+  std::string path;
+  int from_id = 1;
+  int page_size = 100;
+  int jobs = 4;
+  bool show_changes = false;
+
+  for (size_t i = 0; i < args.size(); i++) {
+    if (args[i] == "-c" || args[i] == "--changes") {
+      show_changes = true;
+      continue;
+    }
+    if (parse_int_option(args, i, "-j", "--jobs", jobs))
+      continue;
+    if (parse_int_option(args, i, "-f", "--from", from_id))
+      continue;
+    if (parse_int_option(args, i, "-p", "--page-size", page_size))
+      continue;
+    path = args[i];
+  }
+
+  if (path.empty()) {
+    fprintf(stderr, "You must specify an argument: tf history [--from N] $/Folder1\n");
+    return;
+  }
+
+  TfsProxy tfs(AppConfig.Get("tfs", "base_url"), path,
+      AppConfig.Get("tfs", "username"), AppConfig.Get("tfs", "password"));
+  if (!configure_auth(tfs))
+    return;
+  // The pages (and the long comments) are queued on the executor, which
+  // runs a single transfer at a time unless told otherwise.
+  http::HttpExecutor& executor = http::HttpExecutor::default_instance();
+  executor.set_max_transfers(jobs);
+  configure_executor(executor);
+
+  if (!tfs.GetChangesAfter(from_id, [&tfs, show_changes,
+      jobs](const ChangesetInfo& ci) {
+    // Only the first line of the comment.
+    std::string comment = ci.Comment.substr(0, ci.Comment.find_first_of("\r\n"));
+    printf("%8d %-24s %s\n", ci.ChangesetId, ci.Author.c_str(),
+        comment.c_str());
+
+    if (show_changes && !tfs.GetChangesetChanges(ci.ChangesetId,
+        [](const ChangesetChange& change) {
+      printf("           %-8s %s\n", change.ChangeType.c_str(),
+          change.Path.c_str());
+      return true;
+    }, 1000, jobs)) {
+      fprintf(stderr, "Unable to get the changes of changeset %d\n",
+          ci.ChangesetId);
+    }
+    return true;
+  }, page_size, jobs)) {
+    fprintf(stderr, "Unable to get the history of %s\n", path.c_str());
+  }
 }
 
 struct cmd_operation {
@@ -76,6 +931,10 @@ struct cmd_operation {
 
 cmd_operation operations[] = {
   { "clone", cmd_clone },
+  { "stat", cmd_stat },
+  { "ls", cmd_ls },
+  { "du", cmd_du },
+  { "history", cmd_history },
   { nullptr, nullptr }
 };
 
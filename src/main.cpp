@@ -38,6 +38,27 @@ static void usage(int err)
 
   fprintf(stderr, "usage: %s (cmd)\n", _pname);
   fprintf(stderr, "\tclone    - get latest.\n");
+  fprintf(stderr, "\t           --jobs N  download N files concurrently.\n");
+  fprintf(stderr, "\t           --prewarm N  authenticate N connections up front\n");
+  fprintf(stderr, "\t                        (defaults to the number of jobs).\n");
+  fprintf(stderr, "\t           --listing full  list the whole tree with one request\n");
+  fprintf(stderr, "\t                           (default: onelevel, one per folder).\n");
+  fprintf(stderr, "\t           --listing parallel  list subtrees concurrently, splitting\n");
+  fprintf(stderr, "\t                               those that take longer than\n");
+  fprintf(stderr, "\t                               --listing-timeout N seconds (30).\n");
+  fprintf(stderr, "\t           --stats   print connection statistics.\n");
+  fprintf(stderr, "\tstat     - show the version of each given path (- reads\n");
+  fprintf(stderr, "\t           paths from stdin).\n");
+  fprintf(stderr, "\t           --version N  at changeset N instead of the latest.\n");
+  fprintf(stderr, "\tls       - list a folder without downloading it.\n");
+  fprintf(stderr, "\t           -R  everything below it.\n");
+  fprintf(stderr, "\tdu       - show the bytes and files below each folder.\n");
+  fprintf(stderr, "\t           -s  the total only.\n");
+  fprintf(stderr, "\thistory  - list the changesets of a path, oldest first.\n");
+  fprintf(stderr, "\t           --from N  start at changeset N.\n");
+  fprintf(stderr, "\t           --page-size N  changesets per request (100).\n");
+  fprintf(stderr, "\t           --jobs N  fetch N pages concurrently (4).\n");
+  fprintf(stderr, "\t           --changes  list the changed items as well.\n");
   exit(err);
 }
 
@@ -26,6 +26,7 @@ struct ChangesetInfo {
   int ChangesetId;
   std::string Author;
   std::string Comment;
+  bool CommentTruncated;  // the listing cut Comment short.
 
   std::vector<ChangesetChange> changes;
 };
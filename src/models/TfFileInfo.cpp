@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2017 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "models/TfFileInfo.h"
+
+using utils::JsonField;
+using utils::JsonSchema;
+using utils::MakeSchema;
+using utils::SetBool;
+using utils::SetInt;
+using utils::SetInt64;
+using utils::SetString;
+
+// Older servers only have the encoding in contentMetadata. The top level
+// one wins, whichever comes first.
+static void set_metadata_encoding(TfFileInfo& file,
+    const utils::JsonScalar& value)
+{
+  if (file.Encoding == TfFileInfo::UnknownEncoding)
+    SetInt<TfFileInfo, &TfFileInfo::Encoding>(file, value);
+}
+
+static const JsonField<TfFileInfo> content_metadata_fields[] = {
+  { "encoding", set_metadata_encoding, NULL },
+};
+static const JsonSchema<TfFileInfo> content_metadata_schema =
+  MakeSchema(content_metadata_fields);
+
+static const JsonField<TfFileInfo> item_fields[] = {
+  { "version", SetInt<TfFileInfo, &TfFileInfo::Version>, NULL },
+  { "path", SetString<TfFileInfo, &TfFileInfo::Path>, NULL },
+  { "url", SetString<TfFileInfo, &TfFileInfo::Url>, NULL },
+  { "isFolder", SetBool<TfFileInfo, &TfFileInfo::IsFolder>, NULL },
+  { "size", SetInt64<TfFileInfo, &TfFileInfo::Size>, NULL },
+  { "hashValue", SetString<TfFileInfo, &TfFileInfo::HashValue>, NULL },
+  { "encoding", SetInt<TfFileInfo, &TfFileInfo::Encoding>, NULL },
+  { "contentMetadata", NULL, &content_metadata_schema },
+};
+const JsonSchema<TfFileInfo> TfFileInfoSchema = MakeSchema(item_fields);
@@ -17,14 +17,26 @@
 #ifndef MODELS_TFFILEINFO_H
 #define MODELS_TFFILEINFO_H
 
+#include <cstdint>
 #include <string>
 
+#include "utils/jsonschema.h"
+
 struct TfFileInfo {
+  // Encoding of items that do not tell theirs (folders, among others).
+  static const int UnknownEncoding = -2;
+
   int Version;
   bool IsFolder;
   std::string Path;
   std::string Url;
+  int64_t Size;           // content length in bytes, files only.
+  std::string HashValue;  // base64 MD5 of the content, files only.
+  int Encoding = UnknownEncoding; // code page of the content, -1 for binary.
 };
 
+// Where the members of an item in a listing go.
+extern const utils::JsonSchema<TfFileInfo> TfFileInfoSchema;
+
 #endif // MODELS_TFFILEINFO_H
 
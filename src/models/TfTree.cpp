@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2017 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cctype>
+
+#include "models/TfTree.h"
+#include "utils/md5.h"
+
+// Parent of the root and of nodes whose folder is missing.
+static const TfTree::Index no_parent = UINT32_MAX;
+
+static const size_t md5_size = 16;
+
+// Whether the first len characters of a and b match, ignoring (ASCII)
+// case. Both have at least len characters.
+static bool same_prefix(const std::string &a, const std::string &b,
+    size_t len)
+{
+  for (size_t i = 0; i < len; i++) {
+    if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+      return false;
+  }
+  return true;
+}
+
+bool TfTree::SamePath(const std::string &a, const std::string &b)
+{
+  return a.size() == b.size() && same_prefix(a, b, a.size());
+}
+
+TfTree::TfTree() : _root_node(no_parent)
+{
+}
+
+void TfTree::Begin(const std::string &root)
+{
+  _root = root;
+  _parent.clear();
+  _name.clear();
+  _version.clear();
+  _folder.clear();
+  _bytes.clear();
+  _md5.clear();
+  _first_child.clear();
+  _names.clear();
+  _interned.clear();
+  _folders.clear();
+  _orphans.clear();
+  _root_node = no_parent;
+}
+
+uint32_t TfTree::intern(const std::string &name)
+{
+  auto it = _interned.find(name);
+  if (it != _interned.end())
+    return it->second;
+
+  uint32_t offset = _names.size();
+  _names.insert(_names.end(), name.begin(), name.end());
+  _names.push_back('\0');
+  _interned[name] = offset;
+  return offset;
+}
+
+void TfTree::Add(const std::string &path, int version, bool folder,
+    int64_t bytes, const std::string &hash)
+{
+  Index node = _version.size();
+  Index parent = no_parent;
+
+  if (SamePath(path, _root)) {
+    if (_root_node != no_parent)
+      return;
+    // The other items spell the root as the server does.
+    _root = path;
+    _root_node = node;
+    _name.push_back(intern(path));
+  } else {
+    if (path.size() <= _root.size() + 1 ||
+        !same_prefix(path, _root, _root.size()) ||
+        path[_root.size()] != '/') {
+      return;
+    }
+
+    std::string::size_type last_slash = path.rfind('/');
+    auto found = _folders.find(path.substr(0, last_slash));
+    if (found != _folders.end()) {
+      parent = found->second;
+    } else {
+      _orphans.push_back(std::make_pair(node, path.substr(0, last_slash)));
+    }
+    _name.push_back(intern(path.substr(last_slash + 1)));
+  }
+
+  if (folder)
+    _folders[path] = node;
+  _parent.push_back(parent);
+  _version.push_back(version);
+  _folder.push_back(folder ? 1 : 0);
+  _bytes.push_back(bytes);
+
+  std::string md5 = utils::DecodeMd5Hash(hash);
+  md5.resize(md5_size);
+  _md5.insert(_md5.end(), md5.begin(), md5.end());
+}
+
+bool TfTree::Finish()
+{
+  size_t count = _version.size();
+  Index root = _root_node;
+
+  // Folders listed after their items.
+  for (const auto &orphan : _orphans) {
+    auto found = _folders.find(orphan.second);
+    if (found != _folders.end())
+      _parent[orphan.first] = found->second;
+  }
+
+  _interned.clear();
+  _folders.clear();
+  _orphans.clear();
+  if (root == no_parent) {
+    Begin(_root);
+    return false;
+  }
+
+  // Group the nodes by parent, keeping the listing order within a folder.
+  std::vector<Index> first(count + 1, 0);
+  for (Index i = 0; i < count; i++) {
+    if (_parent[i] != no_parent)
+      first[_parent[i] + 1]++;
+  }
+  for (size_t i = 0; i < count; i++)
+    first[i + 1] += first[i];
+
+  std::vector<Index> grouped(first[count]);
+  std::vector<Index> fill(first.begin(), first.end() - 1);
+  for (Index i = 0; i < count; i++) {
+    if (_parent[i] != no_parent)
+      grouped[fill[_parent[i]]++] = i;
+  }
+
+  // Number the nodes reachable from the root breadth first.
+  std::vector<Index> order;
+  std::vector<Index> renumbered(count, no_parent);
+  order.reserve(count);
+  order.push_back(root);
+  renumbered[root] = 0;
+
+  std::vector<Index> first_child;
+  first_child.reserve(count + 1);
+  for (size_t k = 0; k < order.size(); k++) {
+    Index old = order[k];
+    first_child.push_back(order.size());
+    for (Index c = first[old]; c < first[old + 1]; c++) {
+      renumbered[grouped[c]] = order.size();
+      order.push_back(grouped[c]);
+    }
+  }
+  first_child.push_back(order.size());
+
+  std::vector<Index> parent(order.size());
+  std::vector<uint32_t> name(order.size());
+  std::vector<int> version(order.size());
+  std::vector<uint8_t> is_folder(order.size());
+  std::vector<int64_t> bytes(order.size());
+  std::vector<char> md5(order.size() * md5_size);
+  for (size_t k = 0; k < order.size(); k++) {
+    Index old = order[k];
+    parent[k] = k == 0 ? no_parent : renumbered[_parent[old]];
+    name[k] = _name[old];
+    version[k] = _version[old];
+    is_folder[k] = _folder[old];
+    bytes[k] = _bytes[old];
+    std::copy(&_md5[old * md5_size], &_md5[(old + 1) * md5_size],
+        &md5[k * md5_size]);
+  }
+
+  _parent.swap(parent);
+  _name.swap(name);
+  _version.swap(version);
+  _folder.swap(is_folder);
+  _bytes.swap(bytes);
+  _md5.swap(md5);
+  _first_child.swap(first_child);
+  _names.shrink_to_fit();
+  return true;
+}
+
+bool TfTree::Build(const std::string &root, std::vector<TfFileInfo> &items)
+{
+  Begin(root);
+  for (const auto &item : items)
+    Add(item.Path, item.Version, item.IsFolder, item.Size, item.HashValue);
+  items.clear();
+  return Finish();
+}
+
+std::string TfTree::Md5(Index node) const
+{
+  const char *md5 = &_md5[node * md5_size];
+  if (std::count(md5, md5 + md5_size, '\0') == (long)md5_size)
+    return std::string();
+  return std::string(md5, md5_size);
+}
+
+std::string TfTree::Path(Index node) const
+{
+  if (node == 0)
+    return _root;
+  return Path(_parent[node]) + "/" + Name(node);
+}
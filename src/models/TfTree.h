@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2017 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MODELS_TFTREE_H
+#define MODELS_TFTREE_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "models/TfFileInfo.h"
+
+// Items below a scope path, arranged as a tree. Built from the items of a
+// recursive (recursionLevel=Full) listing.
+//
+// Large listings have to fit, so nothing is kept per item but a few
+// integers: the nodes are stored as parallel arrays, and each node refers
+// to its name in a shared arena where every distinct name is kept once.
+// Paths are rebuilt from the names. Nodes are numbered breadth first, so
+// the children of a folder are the consecutive nodes
+// [FirstChild(), EndChild()).
+class TfTree {
+public:
+  typedef uint32_t Index;
+
+  TfTree();
+
+  // Start over with the given root. Add() the items in any order, then
+  // Finish(). Items outside of root or without a listed parent folder are
+  // dropped. Finish() returns false if root was not among the items. The
+  // root is matched regardless of case, and takes the spelling of the
+  // item.
+  void Begin(const std::string &root);
+  void Add(const std::string &path, int version, bool folder,
+      int64_t bytes = 0, const std::string &hash = std::string());
+  bool Finish();
+
+  // All in one go, the items are consumed.
+  bool Build(const std::string &root, std::vector<TfFileInfo> &items);
+
+  bool Empty() const { return _version.empty(); }
+  size_t Size() const { return _version.size(); }
+  Index Root() const { return 0; }
+
+  Index Parent(Index node) const { return _parent[node]; }
+  Index FirstChild(Index node) const { return _first_child[node]; }
+  Index EndChild(Index node) const { return _first_child[node + 1]; }
+  int Version(Index node) const { return _version[node]; }
+  bool IsFolder(Index node) const { return _folder[node] != 0; }
+  int64_t Bytes(Index node) const { return _bytes[node]; }
+  // MD5 digest of a file (16 bytes), empty if the listing had none.
+  std::string Md5(Index node) const;
+
+  // TFVC paths do not depend on case.
+  static bool SamePath(const std::string &a, const std::string &b);
+
+  // Name of the item within its folder, the path of the root.
+  const char *Name(Index node) const { return &_names[_name[node]]; }
+  std::string Path(Index node) const;
+
+private:
+  uint32_t intern(const std::string &name);
+
+  std::string _root;
+
+  // One entry per node.
+  std::vector<Index> _parent;
+  std::vector<uint32_t> _name;      // offset into _names.
+  std::vector<int> _version;
+  std::vector<uint8_t> _folder;
+  std::vector<int64_t> _bytes;
+  std::vector<char> _md5;           // 16 bytes per node, zeros if none.
+  std::vector<Index> _first_child;  // one more, closing the last range.
+
+  std::vector<char> _names;         // NUL terminated names.
+
+  // Only while building.
+  std::unordered_map<std::string, uint32_t> _interned;
+  std::unordered_map<std::string, Index> _folders;
+  std::vector<std::pair<Index, std::string> > _orphans; // parent not seen.
+  Index _root_node;
+};
+
+#endif // MODELS_TFTREE_H
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2012-2019 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "services/decodepool.h"
+
+namespace http {
+
+DecodePool::DecodePool(int threads, const std::function<void()> &notify) :
+  m_stop(false), m_notify(notify)
+{
+  for (int i = 0; i < threads; i++)
+    m_threads.push_back(std::thread(&DecodePool::run, this));
+}
+
+DecodePool::~DecodePool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_work.notify_all();
+  for (std::thread &thread : m_threads)
+    thread.join();
+}
+
+void
+DecodePool::submit(const Job &work, const Job &done)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.push_back(std::make_pair(work, done));
+  }
+  m_work.notify_one();
+}
+
+std::vector<DecodePool::Job>
+DecodePool::take_done()
+{
+  std::vector<Job> done;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  done.swap(m_done);
+  return done;
+}
+
+void
+DecodePool::run()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  for (;;) {
+    m_work.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+    if (m_jobs.empty())
+      break;
+
+    std::pair<Job, Job> job = std::move(m_jobs.front());
+    m_jobs.pop_front();
+    lock.unlock();
+
+    job.first();
+
+    lock.lock();
+    m_done.push_back(std::move(job.second));
+
+    lock.unlock();
+    m_notify();
+    lock.lock();
+  }
+}
+
+} // namespace http
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2012-2019 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SERVICES_DECODEPOOL_H
+#define SERVICES_DECODEPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace http {
+
+// Runs CPU bound work, such as parsing response bodies, on threads of its
+// own so that the network loop keeps servicing transfers meanwhile. Each
+// job comes with a completion, which is handed back through take_done() to
+// be run on the network thread. notify is called from the pool thread
+// whenever a completion is ready.
+class DecodePool {
+public:
+  typedef std::function<void()> Job;
+
+  DecodePool(int threads, const std::function<void()> &notify);
+  ~DecodePool();
+
+  // Run work on a pool thread. Once it has returned, done is queued for
+  // take_done().
+  void submit(const Job &work, const Job &done);
+
+  std::vector<Job> take_done();
+
+  int threads() const { return (int)m_threads.size(); }
+
+private:
+  DecodePool(const DecodePool &);
+
+  void run();
+
+  std::mutex m_mutex;
+  std::condition_variable m_work;
+  std::deque<std::pair<Job, Job> > m_jobs;
+  std::vector<Job> m_done;
+  bool m_stop;
+  std::function<void()> m_notify;
+  std::vector<std::thread> m_threads;
+};
+
+} // namespace http
+
+#endif /* SERVICES_DECODEPOOL_H */
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2012-2019 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstdlib>
+#include <cstring>
+
+#include "services/downloadjournal.h"
+
+DownloadJournal::DownloadJournal() : _fp(NULL)
+{
+}
+
+DownloadJournal::~DownloadJournal()
+{
+  if (_fp != NULL)
+    fclose(_fp);
+}
+
+// One line per entry: version, ETag (possibly empty) and local path,
+// separated by tabs. Later lines win.
+bool DownloadJournal::Open(const std::string &path)
+{
+  _path = path;
+  _entries.clear();
+
+  FILE *fp = fopen(path.c_str(), "r");
+  if (fp != NULL) {
+    char line[4096];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      line[strcspn(line, "\r\n")] = '\0';
+      char *etag = strchr(line, '\t');
+      char *local_path = etag != NULL ? strchr(etag + 1, '\t') : NULL;
+      if (local_path == NULL)
+        continue;
+      *etag++ = '\0';
+      *local_path++ = '\0';
+
+      entry &e = _entries[local_path];
+      e.version = atoi(line);
+      e.etag = etag;
+    }
+    fclose(fp);
+  }
+
+  if (_fp != NULL)
+    fclose(_fp);
+  _fp = fopen(path.c_str(), "a");
+  return _fp != NULL;
+}
+
+void DownloadJournal::Remove()
+{
+  if (_fp != NULL) {
+    fclose(_fp);
+    _fp = NULL;
+  }
+  if (!_path.empty())
+    remove(_path.c_str());
+  _entries.clear();
+}
+
+bool DownloadJournal::Find(const std::string &local_path, int &version,
+    std::string &etag) const
+{
+  auto it = _entries.find(local_path);
+  if (it == _entries.end())
+    return false;
+
+  version = it->second.version;
+  etag = it->second.etag;
+  return true;
+}
+
+void DownloadJournal::Record(const std::string &local_path, int version,
+    const std::string &etag, bool failed)
+{
+  if (_fp == NULL)
+    return;
+  fprintf(_fp, "%d\t%s\t%s\n", version, etag.c_str(), local_path.c_str());
+  if (failed)
+    fflush(_fp);
+}
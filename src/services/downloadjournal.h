@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2012-2019 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SERVICES_DOWNLOADJOURNAL_H
+#define SERVICES_DOWNLOADJOURNAL_H
+
+#include <cstdio>
+
+#include <string>
+#include <unordered_map>
+
+// Remembers the item version (and the ETag, once known) that each
+// <file>.partial of a clone holds, so that a later run can resume it. One
+// journal serves the whole clone: a line is appended as a download starts
+// or fails, rather than keeping a file next to every download.
+//
+// Lines are buffered, a run that gets killed may lose the last few. Their
+// partial files are then downloaded again from the start.
+class DownloadJournal {
+public:
+  DownloadJournal();
+  ~DownloadJournal();
+
+  // Read what an earlier run left at path, and append to it from now on.
+  bool Open(const std::string &path);
+
+  // Delete the journal, once no partial file is left.
+  void Remove();
+
+  // What the partial file of local_path holds. Returns false if it is not
+  // known.
+  bool Find(const std::string &local_path, int &version,
+      std::string &etag) const;
+
+  // The partial file of local_path holds version. Failures are written
+  // out right away. Only later runs Find() what is recorded.
+  void Record(const std::string &local_path, int version,
+      const std::string &etag, bool failed = false);
+
+private:
+  DownloadJournal(const DownloadJournal &);
+
+  struct entry {
+    int version;
+    std::string etag;
+  };
+
+  std::string _path;
+  FILE *_fp;
+  std::unordered_map<std::string, entry> _entries;
+};
+
+#endif /* SERVICES_DOWNLOADJOURNAL_H */
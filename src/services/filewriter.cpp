@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2012-2019 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cerrno>
+
+#include "services/filewriter.h"
+
+namespace http {
+
+FileWriter::FileWriter(size_t max_bytes,
+    const std::function<void()> &notify) : m_max_bytes(max_bytes),
+  m_queued(0), m_peak(0), m_refused(false), m_busy(false), m_stop(false),
+  m_notify(notify)
+{
+  m_thread = std::thread(&FileWriter::run, this);
+}
+
+FileWriter::~FileWriter()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_work.notify_one();
+  m_thread.join();
+}
+
+bool
+FileWriter::write(FILE *fp, const char *data, size_t len)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_queued > 0 && m_queued + len > m_max_bytes) {
+      m_refused = true;
+      return false;
+    }
+
+    m_ops.push_back(op());
+    m_ops.back().fp = fp;
+    m_ops.back().data.assign(data, len);
+    m_ops.back().close = false;
+    m_ops.back().token = NULL;
+    m_queued += len;
+    if (m_queued > m_peak)
+      m_peak = m_queued;
+  }
+  m_work.notify_one();
+  return true;
+}
+
+void
+FileWriter::close(FILE *fp, void *token)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_ops.push_back(op());
+    m_ops.back().fp = fp;
+    m_ops.back().close = true;
+    m_ops.back().token = token;
+  }
+  m_work.notify_one();
+}
+
+void
+FileWriter::sync()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_idle.wait(lock, [this] { return m_ops.empty() && !m_busy; });
+}
+
+std::vector<std::pair<void *, int> >
+FileWriter::take_closed()
+{
+  std::vector<std::pair<void *, int> > closed;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  closed.swap(m_closed);
+  return closed;
+}
+
+bool
+FileWriter::has_room() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_queued <= m_max_bytes / 2;
+}
+
+size_t
+FileWriter::queued_bytes() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_queued;
+}
+
+size_t
+FileWriter::peak_bytes() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_peak;
+}
+
+void
+FileWriter::run()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  for (;;) {
+    m_work.wait(lock, [this] { return m_stop || !m_ops.empty(); });
+    if (m_ops.empty())
+      break;
+
+    op next = std::move(m_ops.front());
+    m_ops.pop_front();
+    m_busy = true;
+    lock.unlock();
+
+    int error = 0;
+    if (next.close) {
+      if (fclose(next.fp) != 0)
+        error = errno;
+    } else if (fwrite(next.data.data(), 1, next.data.size(), next.fp) !=
+        next.data.size()) {
+      error = errno != 0 ? errno : EIO;
+    }
+
+    lock.lock();
+    m_busy = false;
+    m_queued -= next.data.size();
+
+    bool notify = next.close;
+    if (m_refused && m_queued <= m_max_bytes / 2) {
+      m_refused = false;
+      notify = true;
+    }
+
+    if (next.close) {
+      // The FILE may be reused by the next fopen, forget about it now.
+      auto it = m_errors.find(next.fp);
+      if (it != m_errors.end()) {
+        error = it->second;
+        m_errors.erase(it);
+      }
+      m_closed.push_back(std::make_pair(next.token, error));
+    } else if (error != 0 && m_errors.find(next.fp) == m_errors.end()) {
+      m_errors[next.fp] = error;
+    }
+
+    if (m_ops.empty())
+      m_idle.notify_all();
+
+    if (notify) {
+      lock.unlock();
+      m_notify();
+      lock.lock();
+    }
+  }
+}
+
+} // namespace http
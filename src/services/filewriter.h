@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2012-2019 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SERVICES_FILEWRITER_H
+#define SERVICES_FILEWRITER_H
+
+#include <cstdio>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace http {
+
+// Writes downloaded data to disk on a thread of its own, so that the
+// transfers do not wait for the disk. The amount of queued data is bounded:
+// when the queue is full, write() refuses the data and the caller has to
+// offer it again later. notify is called from the writer thread whenever a
+// file has been closed, or the queue has room again after refusing data.
+class FileWriter {
+public:
+  FileWriter(size_t max_bytes, const std::function<void()> &notify);
+  ~FileWriter();
+
+  // Queue len bytes for fp. Returns false, queueing nothing, if the queue
+  // is full. An empty queue accepts any amount.
+  bool write(FILE *fp, const char *data, size_t len);
+
+  // Queue closing fp. The token comes back from take_closed() once the file
+  // is closed, along with the first error writing or closing it.
+  void close(FILE *fp, void *token);
+
+  // Wait until everything queued so far is on disk.
+  void sync();
+
+  std::vector<std::pair<void *, int> > take_closed();
+
+  // Whether writers that were turned away should try again.
+  bool has_room() const;
+
+  size_t queued_bytes() const;
+  size_t peak_bytes() const;
+  size_t max_bytes() const { return m_max_bytes; }
+
+private:
+  FileWriter(const FileWriter &);
+
+  struct op {
+    FILE *fp;
+    std::string data;
+    bool close;
+    void *token;
+  };
+
+  void run();
+
+  size_t m_max_bytes;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_work;
+  std::condition_variable m_idle;
+  std::deque<op> m_ops;
+  size_t m_queued; // bytes in m_ops.
+  size_t m_peak;
+  bool m_refused; // write() turned data away since the queue had room.
+  bool m_busy; // an op is being carried out outside the lock.
+  bool m_stop;
+  std::map<FILE *, int> m_errors; // first error of each open file.
+  std::vector<std::pair<void *, int> > m_closed;
+  std::function<void()> m_notify;
+  std::thread m_thread;
+};
+
+} // namespace http
+
+#endif /* SERVICES_FILEWRITER_H */
@@ -17,10 +17,28 @@
 #include <curl/curl.h>
 #include <curl/easy.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cstring>
 #include <cstdlib>
 #include <string>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <cerrno>
+#include <cstdint>
+#endif
+
+#include "services/decodepool.h"
+#include "services/filewriter.h"
 #include "services/http.h"
 #include "utils/logging.h"
 
@@ -28,11 +46,6 @@ namespace http {
 
 /* HTTP Services version 1.102 (06-17-2019) */
 
-struct http_context {
-  HttpRequest *req;
-  HttpResponse *resp;
-};
-
 /* Modern Chrome on Windows 10 */
 static const char *chrome_win10_ua = "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/75.0.3770.90 Safari/537.36";
 
@@ -56,30 +69,206 @@ http_lib_shutdown(void)
 {
 }
 
-HttpExecutor::HttpExecutor()
+bool
+parse_auth_scheme(const std::string &name, AuthScheme &scheme)
+{
+  if (name.empty() || name == "ntlm") {
+    scheme = AUTH_NTLM;
+  } else if (name == "basic") {
+    scheme = AUTH_BASIC;
+  } else if (name == "pat") {
+    scheme = AUTH_PAT;
+  } else if (name == "negotiate") {
+    scheme = AUTH_NEGOTIATE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+HttpExecutor::HttpExecutor() : m_queued_active(0), m_max_transfers(1),
+  m_multiplex(false), m_compression(false), m_resume_at(0),
+  m_adaptive(false), m_window(1), m_min_latency(0), m_latency(0),
+  m_last_decrease(0), m_stall_timeout(0), m_hedging(false),
+  m_hedge_percentile(0.95), m_hedge_delay(0), m_hedges_active(0),
+  m_latency_pos(0), m_latency_updates(0), m_writer(NULL), m_closing(0),
+  m_decoder(NULL), m_decoding(0),
+#ifdef __linux__
+  m_epoll_fd(-1), m_timer_fd(-1), m_wake_fd(-1),
+#endif
+  m_stats()
 {
   m_multi_handle = curl_multi_init();
+
+  set_compression(true);
+
+  /* All transfers are driven from the thread that owns the executor, so the
+   * share object needs no lock callbacks. */
+  m_share_handle = curl_share_init();
+  curl_share_setopt(m_share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(m_share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(m_share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
 }
 
 HttpExecutor::~HttpExecutor()
 {
+  delete m_decoder;
+  delete m_writer;
+  for (CURL *hnd : m_idle_handles) {
+    curl_easy_cleanup(hnd);
+  }
   curl_multi_cleanup(m_multi_handle);
+  curl_share_cleanup(m_share_handle);
+#ifdef __linux__
+  if (m_epoll_fd != -1) {
+    close(m_wake_fd);
+    close(m_timer_fd);
+    close(m_epoll_fd);
+  }
+#endif
+}
+
+CURL *
+HttpExecutor::acquire_handle()
+{
+  CURL *hnd;
+
+  if (!m_idle_handles.empty()) {
+    hnd = m_idle_handles.back();
+    m_idle_handles.pop_back();
+  } else {
+    hnd = curl_easy_init();
+  }
+
+  curl_easy_setopt(hnd, CURLOPT_SHARE, m_share_handle);
+  curl_easy_setopt(hnd, CURLOPT_CLOSESOCKETFUNCTION, close_socket);
+  curl_easy_setopt(hnd, CURLOPT_CLOSESOCKETDATA, this);
+  return hnd;
+}
+
+int
+HttpExecutor::close_socket(void *clientp, curl_socket_t item)
+{
+  HttpExecutor *executor = static_cast<HttpExecutor *>(clientp);
+
+  executor->m_authenticated.erase(item);
+#ifdef _WIN32
+  return closesocket(item);
+#else
+  return close(item);
+#endif
+}
+
+/* Update the statistics with a finished transfer, and remember which
+ * connections are already authenticated. */
+void
+HttpExecutor::account(HttpRequest *req)
+{
+  long connects = 0;
+  int challenges = req->m_ctx.auth_challenges;
+
+  curl_easy_getinfo(req->m_handle, CURLINFO_NUM_CONNECTS, &connects);
+
+  curl_off_t wire_bytes = 0;
+  curl_easy_getinfo(req->m_handle, CURLINFO_SIZE_DOWNLOAD_T, &wire_bytes);
+
+  m_stats.requests++;
+  m_stats.connects += connects;
+  m_stats.wire_bytes += wire_bytes;
+  m_stats.body_bytes += req->m_ctx.body_bytes;
+  m_stats.auth_round_trips += challenges;
+  if (challenges > 0)
+    m_stats.auth_handshakes++;
+
+  if (!req->m_conn_auth)
+    return;
+
+  curl_socket_t sock = CURL_SOCKET_BAD;
+  curl_easy_getinfo(req->m_handle, CURLINFO_ACTIVESOCKET, &sock);
+  if (sock == CURL_SOCKET_BAD)
+    return;
+
+  if (challenges == 0 && m_authenticated.count(sock))
+    m_stats.auth_reused++;
+
+  long status_code = 0;
+  curl_easy_getinfo(req->m_handle, CURLINFO_RESPONSE_CODE, &status_code);
+  if (status_code == 401) {
+    m_authenticated.erase(sock);
+  } else {
+    m_authenticated.insert(sock);
+  }
+}
+
+void
+HttpExecutor::release_handle(CURL *hnd)
+{
+  /* Resetting the options keeps the live connections and caches attached
+   * to the handle. */
+  curl_easy_reset(hnd);
+  m_idle_handles.push_back(hnd);
 }
 
 /* Private generic response reading function */
 static size_t
-dk_httpread(char *ptr, size_t size, size_t nmemb, HttpResponse *hr)
+dk_httpread(char *ptr, size_t size, size_t nmemb, http_context *ctx)
 {
+  static const char continue_line[] = "HTTP/1.1 100 Continue";
   size_t totalsz = size * nmemb;
 
-  if (strstr(ptr, "HTTP/1.1 100 Continue"))
+  /* The chunk is not NUL terminated (decompressed chunks in particular), so
+   * only compare what is there. */
+  if (totalsz >= sizeof(continue_line) - 1 &&
+      memcmp(ptr, continue_line, sizeof(continue_line) - 1) == 0)
     return totalsz;
 
-  hr->body.append((char *)ptr, totalsz);
+  /* Returning less than was passed aborts the transfer. */
+  if (ctx->max_body > 0 &&
+      ctx->body_bytes + (curl_off_t)totalsz > ctx->max_body)
+    return 0;
+
+  ctx->body_bytes += totalsz;
+  if (ctx->sink != NULL && ctx->status_code >= 200 &&
+      ctx->status_code <= 299) {
+    if (!ctx->sink->write(ptr, totalsz))
+      return 0;
+  } else {
+    ctx->resp->body.append((char *)ptr, totalsz);
+  }
   return totalsz;
 
 }
 
+/* Response headers, for both buffered and file transfers. */
+static size_t
+dk_httpheader(char *ptr, size_t size, size_t nmemb, http_context *ctx)
+{
+  size_t totalsz = size * nmemb;
+  std::string hdr(ptr, totalsz);
+  std::string::size_type n;
+
+  n = hdr.find('\r');
+  if (n != std::string::npos) {
+    hdr.erase(n);
+  }
+  n = hdr.find('\n');
+  if (n != std::string::npos) {
+    hdr.erase(n);
+  }
+
+  /* Each response in an authentication exchange starts with its own status
+   * line; a 401 is the server asking for (more) credentials. */
+  long status_code;
+  if (sscanf(hdr.c_str(), "HTTP/%*s %ld", &status_code) == 1) {
+    ctx->status_code = status_code;
+    if (status_code == 401)
+      ctx->auth_challenges++;
+  }
+
+  ctx->resp->headers.push_back(hdr);
+  return totalsz;
+}
+
 const char *
 http_get_error_str(int error_code)
 {
@@ -90,9 +279,6 @@ static int
 curl_debug_func(CURL *hnd, curl_infotype info, char *data, size_t len,
     http_context *ctx)
 {
-  std::string hdr;
-  std::string::size_type n;
-
   switch (info) {
   case CURLINFO_HEADER_OUT:
     if (ctx->req->verbose()) {
@@ -108,20 +294,10 @@ curl_debug_func(CURL *hnd, curl_infotype info, char *data, size_t len,
     }
     break;
   case CURLINFO_HEADER_IN:
-    hdr = std::string(data, len);
-
     if (ctx->req->verbose()) {
-      log_msgraw(0, "H<: %s", hdr.c_str());
-    }
-    n = hdr.find('\r');
-    if (n != std::string::npos) {
-      hdr.erase(n);
-    }
-    n = hdr.find('\n');
-    if (n != std::string::npos) {
-      hdr.erase(n);
+      std::string verb(data, len);
+      log_msgraw(0, "H<: %s", verb.c_str());
     }
-    ctx->resp->headers.push_back(hdr);
     break;
   case CURLINFO_DATA_IN:
     if (ctx->req->verbose()) {
@@ -141,198 +317,1411 @@ curl_debug_func(CURL *hnd, curl_infotype info, char *data, size_t len,
   return 0;
 }
 
-static CURLcode
-easy_perform(CURLM *mhnd, CURL *hnd)
+void
+HttpExecutor::set_max_transfers(int max_transfers)
 {
-  CURLcode result = CURLE_OK;
-  CURLMcode mcode = CURLM_OK;
-  int done = 0; /* bool */
+  m_max_transfers = max_transfers > 0 ? max_transfers : 1;
+  if (m_window > m_max_transfers)
+    m_window = m_max_transfers;
+}
 
-  if (curl_multi_add_handle(mhnd, hnd)) {
-    return CURLE_FAILED_INIT;
+void
+HttpExecutor::set_multiplex(bool enabled, long max_streams)
+{
+  m_multiplex = enabled;
+  curl_multi_setopt(m_multi_handle, CURLMOPT_PIPELINING,
+      enabled ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+#if LIBCURL_VERSION_NUM >= 0x074300
+  if (max_streams > 0) {
+    curl_multi_setopt(m_multi_handle, CURLMOPT_MAX_CONCURRENT_STREAMS,
+        max_streams);
   }
+#endif
+}
+
+bool
+HttpExecutor::set_compression(bool enabled)
+{
+  curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
 
-  while (!done && mcode == 0) {
-    int still_running = 0;
-    int rc;
+  if (enabled && !(info->features & CURL_VERSION_LIBZ)) {
+    m_compression = false;
+    return false;
+  }
+  m_compression = enabled;
+  return true;
+}
 
-    mcode = curl_multi_wait(mhnd, NULL, 0, 1000, &rc);
+/* Monotonic clock in seconds, for retry deadlines and latency tracking. */
+static double
+now_seconds()
+{
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-    if (mcode == 0) {
-      if (rc == 0) {
-        long sleep_ms;
+static bool
+is_throttled(long status_code)
+{
+  return status_code == 429 || status_code == 503;
+}
 
-        /* If it returns without any file descriptor instantly, we need to
-         * avoid busy looping during periods where it has nothing particular
-         * to wait for. */
-        curl_multi_timeout(mhnd, &sleep_ms);
-        if (sleep_ms) {
-          if (sleep_ms > 1000)
-            sleep_ms = 1000;
-          WAITMS(sleep_ms);
+void
+HttpExecutor::set_adaptive(bool enabled)
+{
+  m_adaptive = enabled;
+  m_window = m_max_transfers < 4 ? m_max_transfers : 4;
+  m_min_latency = 0;
+  m_latency = 0;
+  m_last_decrease = 0;
+}
 
-        }
-      }
+int
+HttpExecutor::concurrency() const
+{
+  if (!m_adaptive)
+    return m_max_transfers;
+  return (int)m_window;
+}
+
+/* AIMD: open the window by one transfer per window's worth of fast
+ * responses, halve it when the server throttles us or the time to first
+ * byte rises well above the best seen so far. */
+void
+HttpExecutor::adapt(HttpRequest *req, CURLcode result, long status_code)
+{
+  if (!m_adaptive || !req->m_limited)
+    return;
+
+  bool decrease = is_throttled(status_code);
+
+  if (!decrease) {
+    if (result != CURLE_OK || status_code < 200 || status_code > 299)
+      return;
+
+    double pretransfer = 0, starttransfer = 0;
+    curl_easy_getinfo(req->m_handle, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+    curl_easy_getinfo(req->m_handle, CURLINFO_STARTTRANSFER_TIME,
+        &starttransfer);
+    double latency = starttransfer - pretransfer;
+
+    if (m_min_latency == 0 || latency < m_min_latency)
+      m_min_latency = latency;
+    m_latency = (m_latency == 0) ? latency : 0.8 * m_latency + 0.2 * latency;
+
+    /* A few milliseconds of slack keeps noise on fast links from counting
+     * as congestion. */
+    decrease = m_latency > 2 * m_min_latency + 0.005;
+  }
+
+  if (decrease) {
+    /* Only react once per round; transfers started before the last
+     * decrease already saw the old window. */
+    if (req->m_started < m_last_decrease)
+      return;
+    m_window = m_window / 2 < 1 ? 1 : m_window / 2;
+    m_last_decrease = now_seconds();
+  } else {
+    m_window += 1.0 / m_window;
+    if (m_window > m_max_transfers)
+      m_window = m_max_transfers;
+  }
+}
+
+void
+HttpExecutor::schedule_retry(HttpRequest *req, double delay)
+{
+  req->m_attempts++;
+  req->reset_response();
+  req->rewind_file();
+  if (req->m_ctx.sink != NULL)
+    req->m_ctx.sink->restart();
+  m_delayed.insert(std::make_pair(now_seconds() + delay, req));
+}
+
+/* Put retries whose delay has passed back in line. */
+void
+HttpExecutor::start_delayed()
+{
+  double now = now_seconds();
 
-      mcode = curl_multi_perform(mhnd, &still_running);
+  while (!m_delayed.empty() && m_delayed.begin()->first <= now) {
+    HttpRequest *req = m_delayed.begin()->second;
+    m_delayed.erase(m_delayed.begin());
+
+    if (req->m_limited) {
+      req->m_limited = false;
+      m_queue.push_front(req);
+    } else if (!attach(req) && req->m_owned) {
+      delete req;
     }
+  }
+}
+
+/* How long the loop may block before a delayed request or the end of a
+ * Retry-After pause needs attention. */
+long
+HttpExecutor::wait_timeout(long cap)
+{
+  double now = now_seconds();
+
+  /* Without a way to wake the loop up, check on the writer and decode
+   * threads often. */
+  if (!can_wake() && m_writer != NULL && cap > 5 &&
+      (m_closing > 0 || m_writer->queued_bytes() > 0))
+    cap = 5;
+  if (!can_wake() && m_decoding > 0 && cap > 1)
+    cap = 1;
 
-    /* Only read still-running if curl_multi_perform returns ok */
-    if (!mcode && still_running == 0) {
-      CURLMsg *msg = curl_multi_info_read(mhnd, &rc);
-      if (msg) {
-        result = msg->data.result;
-        done = 1;
+  double until = now + cap / 1000.0;
+
+  if (!m_delayed.empty() && m_delayed.begin()->first < until)
+    until = m_delayed.begin()->first;
+  if (!m_queue.empty() && m_resume_at > now && m_resume_at < until)
+    until = m_resume_at;
+
+  if (m_hedging && m_hedge_delay > 0) {
+    for (HttpRequest *req : m_active) {
+      if (hedgeable(req) && req->m_started + m_hedge_delay < until) {
+        until = req->m_started + m_hedge_delay;
       }
     }
   }
 
-  if (mcode != 0) {
-    if ((int)mcode == CURLM_OUT_OF_MEMORY)
-      result = CURLE_OUT_OF_MEMORY;
-    else
-      result = CURLE_BAD_FUNCTION_ARGUMENT;
+  long timeout = (long)((until - now) * 1000);
+  return timeout < 0 ? 0 : timeout;
+}
+
+bool
+HttpExecutor::attach(HttpRequest *req)
+{
+  req->m_done = false;
+  req->m_result = CURLE_OK;
+  req->m_started = now_seconds();
+  req->m_hedged = false;
+  req->m_ctx.stats = &m_stats;
+  curl_easy_setopt(req->m_handle, CURLOPT_PRIVATE, req);
+
+  long stall = stall_timeout(req);
+  if (stall > 0) {
+    /* Less than a byte per second for that long counts as stalled. */
+    curl_easy_setopt(req->m_handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(req->m_handle, CURLOPT_LOW_SPEED_TIME, stall);
+  }
+
+  if (req->m_range_from > 0) {
+    /* Ranges count bytes of the encoded body, ask for it unencoded so they
+     * match what the file holds. */
+    curl_easy_setopt(req->m_handle, CURLOPT_ACCEPT_ENCODING, NULL);
+  } else if (m_compression) {
+    /* An empty string offers every encoding curl can decode; bodies reach
+     * the write callbacks already decompressed. */
+    curl_easy_setopt(req->m_handle, CURLOPT_ACCEPT_ENCODING, "");
   }
 
-  curl_multi_remove_handle(mhnd, hnd);
+  if (m_multiplex && req->m_conn_auth) {
+    /* NTLM and Negotiate authenticate the connection, which HTTP/2 does not
+     * allow. Keep them on HTTP/1.1 instead of waiting for the server to
+     * answer HTTP_1_1_REQUIRED. */
+    curl_easy_setopt(req->m_handle, CURLOPT_HTTP_VERSION,
+        CURL_HTTP_VERSION_1_1);
+  } else if (m_multiplex) {
+    /* Ask for HTTP/2 over TLS, and rather wait for a connection that can
+     * multiplex than open a new one for every transfer. */
+    curl_easy_setopt(req->m_handle, CURLOPT_HTTP_VERSION,
+        CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(req->m_handle, CURLOPT_PIPEWAIT, 1L);
+  }
 
-  return result;
+  if (curl_multi_add_handle(m_multi_handle, req->m_handle)) {
+    req->complete(CURLE_FAILED_INIT);
+    return false;
+  }
+  m_active.insert(req);
+  return true;
 }
 
-void HttpRequest::set_content(const char *content_type)
+void
+HttpExecutor::add(HttpRequest *req)
 {
-  std::string ctype_hdr = "Content-Type: ";
-  ctype_hdr.append(content_type);
-  m_headers = curl_slist_append(m_headers, ctype_hdr.c_str());
+  req->m_owned = true;
+  m_queue.push_back(req);
+  start_queued();
 }
 
-HttpResponse HttpRequest::exec(const char *method, const char *data,
-    HttpExecutor& executor)
+void
+HttpExecutor::prewarm(const std::string &url, int connections,
+    const HttpCallback &configure)
 {
-  struct http_context ctx;
-  HttpResponse resp;
+  for (int i = 0; i < connections; i++) {
+    HttpRequest *req = new HttpRequest(url, false, *this);
+    configure(*req);
+    req->prepare("HEAD", NULL);
 
-  if (strcmp(method, "GET") == 0) {
-    curl_easy_setopt(m_handle, CURLOPT_HTTPGET, 1);
-  } else if (strcmp(method, "POST") == 0) {
-    curl_easy_setopt(m_handle, CURLOPT_POST, 1);
-  } else {
-    curl_easy_setopt(m_handle, CURLOPT_CUSTOMREQUEST, method);
+    /* Started right away and all at once, so each one opens (and
+     * authenticates) its own connection instead of queueing behind the
+     * transfer limit. */
+    req->m_owned = true;
+    req->m_max_retries = 0;
+    if (!attach(req))
+      delete req;
   }
+}
 
-  if (data != NULL) {
-    curl_easy_setopt(m_handle, CURLOPT_POSTFIELDS, data);
-    curl_easy_setopt(m_handle, CURLOPT_POSTFIELDSIZE, (long)strlen(data));
-  } else {
-    curl_easy_setopt(m_handle, CURLOPT_POSTFIELDSIZE, 0);
+void
+HttpExecutor::start_queued()
+{
+  /* The server asked us to hold off (Retry-After). */
+  if (m_resume_at > 0 && now_seconds() < m_resume_at)
+    return;
+
+  while (!m_queue.empty() && m_queued_active < (size_t)concurrency()) {
+    HttpRequest *req = m_queue.front();
+    m_queue.pop_front();
+
+    req->m_limited = true;
+    if (attach(req)) {
+      m_queued_active++;
+    } else {
+      delete req;
+    }
+  }
+}
+
+void
+HttpExecutor::finish(CURL *hnd, CURLcode result)
+{
+  HttpRequest *req = NULL;
+
+  curl_easy_getinfo(hnd, CURLINFO_PRIVATE, (char **)&req);
+
+  /* The connection is only reachable from the handle until it is removed. */
+  account(req);
+  detach(req);
+
+  if (req->m_primary != NULL) {
+    finish_hedge(req, result);
+    return;
+  }
+  if (req->m_hedge != NULL) {
+    /* The original answered first, the duplicate is not needed anymore. */
+    HttpRequest *hedge = req->m_hedge;
+    detach(hedge);
+    drop_hedge(hedge);
   }
 
-  curl_easy_setopt(m_handle, CURLOPT_URL, m_url.c_str());
-  curl_easy_setopt(m_handle, CURLOPT_HTTPHEADER, m_headers);
-  curl_easy_setopt(m_handle, CURLOPT_USERAGENT, m_user_agent.c_str());
+  long status_code = 0;
+  curl_easy_getinfo(hnd, CURLINFO_RESPONSE_CODE, &status_code);
+  adapt(req, result, status_code);
 
-  ctx.resp = &resp;
-  ctx.req = this;
-  curl_easy_setopt(m_handle, CURLOPT_DEBUGFUNCTION, curl_debug_func);
-  curl_easy_setopt(m_handle, CURLOPT_DEBUGDATA, &ctx);
-  curl_easy_setopt(m_handle, CURLOPT_VERBOSE, 1);
+  if (retry(req, result, status_code))
+    return;
 
-	curl_easy_setopt(m_handle, CURLOPT_FAILONERROR, 0);
+  if (result == CURLE_OK && status_code >= 200 && status_code <= 299 &&
+      req->m_ctx.fp == NULL && req->m_ctx.sink == NULL)
+    record_latency(now_seconds() - req->m_started);
 
-	/* Verification of SSL is disabled on Windows. This is a limitation of
-	 * curl */
-	curl_easy_setopt(m_handle, CURLOPT_SSL_VERIFYHOST, 0);
-	curl_easy_setopt(m_handle, CURLOPT_SSL_VERIFYPEER, 0);
-	curl_easy_setopt(m_handle, CURLOPT_WRITEDATA, &resp);
-	curl_easy_setopt(m_handle, CURLOPT_WRITEFUNCTION, dk_httpread);
+  conclude(req, result);
+}
 
-  CURLcode res = easy_perform(executor.handle(), m_handle);
-  if (res != CURLE_OK) {
-    log_tmsg(0, "Failure performing request");
+/* Complete a request that left the multi handle. Downloads that go through
+ * the writer thread complete once it has closed their file. */
+void
+HttpExecutor::conclude(HttpRequest *req, CURLcode result, HttpRequest *source)
+{
+  req->record(result, source);
+
+  if (req->m_fp != NULL && req->m_ctx.writer != NULL) {
+    req->m_ctx.writer->close(req->m_fp, req);
+    req->m_fp = NULL;
+    m_closing++;
+    return;
   }
-  curl_easy_getinfo(m_handle, CURLINFO_RESPONSE_CODE, &resp.status_code);
-  curl_easy_getinfo(m_handle, CURLINFO_TOTAL_TIME, &elapsed);
-  resp.elapsed = elapsed;
 
-  return resp;
+  bool owned = req->m_owned;
+  req->notify();
+  if (owned)
+    delete req;
 }
 
-static size_t
-write_file(void *ptr, size_t size, size_t nmemb, FILE *stream)
+/* Complete the downloads whose files the writer has closed. */
+void
+HttpExecutor::collect_closed()
 {
-  size_t written = fwrite(ptr, size, nmemb, stream);
-  return written;
+  if (m_closing == 0)
+    return;
+
+  for (auto& closed : m_writer->take_closed()) {
+    HttpRequest *req = static_cast<HttpRequest *>(closed.first);
+
+    m_closing--;
+    if (closed.second != 0 && req->m_result == CURLE_OK) {
+      log_tmsg(0, "Unable to write download of %s: %s", req->m_url.c_str(),
+          strerror(closed.second));
+      req->m_result = CURLE_WRITE_ERROR;
+    }
+
+    bool owned = req->m_owned;
+    req->notify();
+    if (owned)
+      delete req;
+  }
 }
 
-bool
-HttpRequest::get_file(const char *file)
+/* Continue the transfers that were paused for the writer, once it has
+ * caught up. */
+void
+HttpExecutor::resume_paused()
 {
-  FILE *fp;
+  if (m_writer == NULL || !m_writer->has_room())
+    return;
 
-  fp = fopen(file, "w");
-  if (fp == NULL) {
-    return false;
+  std::vector<HttpRequest *> paused;
+  for (HttpRequest *req : m_active) {
+    if (req->m_ctx.paused)
+      paused.push_back(req);
   }
 
-  bool ret = get_file_fp(fp);
+  /* Resuming delivers the held back data right away, which may pause the
+   * transfer again. */
+  for (HttpRequest *req : paused) {
+    req->m_ctx.paused = false;
+    curl_easy_pause(req->m_handle, CURLPAUSE_CONT);
+  }
+}
 
-  fclose(fp);
-  return ret;
+/* Run the completions of the bodies the decode threads are done with. */
+void
+HttpExecutor::collect_decoded()
+{
+  if (m_decoding == 0)
+    return;
+
+  for (auto& done : m_decoder->take_done()) {
+    m_decoding--;
+    done();
+  }
 }
 
 bool
-HttpRequest::get_file_fp(FILE *fp)
+HttpExecutor::set_decode_threads(int threads)
 {
-  long status_code;
-  curl_easy_setopt(m_handle, CURLOPT_HTTPGET, 1);
-  curl_easy_setopt(m_handle, CURLOPT_POSTFIELDSIZE, 0);
+  if (m_decoding > 0)
+    return false;
 
-  curl_easy_setopt(m_handle, CURLOPT_URL, m_url.c_str());
-  curl_easy_setopt(m_handle, CURLOPT_HTTPHEADER, m_headers);
-  curl_easy_setopt(m_handle, CURLOPT_USERAGENT, m_user_agent.c_str());
+  delete m_decoder;
+  m_decoder = threads > 0 ?
+    new DecodePool(threads, [this] { wakeup(); }) : NULL;
+  return true;
+}
 
-  curl_easy_setopt(m_handle, CURLOPT_FAILONERROR, 0);
+void
+HttpExecutor::decode(const std::function<void()> &work,
+    const std::function<void()> &done)
+{
+  if (m_decoder == NULL || pending() == 0) {
+    work();
+    done();
+    return;
+  }
 
-  curl_easy_setopt(m_handle, CURLOPT_WRITEDATA, fp);
-  curl_easy_setopt(m_handle, CURLOPT_WRITEFUNCTION, write_file);
-  curl_easy_setopt(m_handle, CURLOPT_FOLLOWLOCATION, 1L);
+  m_decoding++;
+  m_decoder->submit(work, done);
+}
 
-  CURLcode res = easy_perform(HttpExecutor::default_instance().handle(), m_handle);
-  if (res != CURLE_OK) {
-    log_tmsg(0, "Failure performing request");
-  }
-  curl_easy_getinfo(m_handle, CURLINFO_RESPONSE_CODE, &status_code);
-  curl_easy_getinfo(m_handle, CURLINFO_TOTAL_TIME, &elapsed);
+bool
+HttpExecutor::set_write_queue(size_t max_bytes)
+{
+  if (m_closing > 0 || !m_active.empty() || !m_queue.empty())
+    return false;
 
+  delete m_writer;
+  m_writer = max_bytes > 0 ?
+    new FileWriter(max_bytes, [this] { wakeup(); }) : NULL;
   return true;
 }
 
-HttpRequest::HttpRequest(const std::string &url, bool verbose) :
-  m_headers(NULL), m_url(url), m_verbose(verbose), m_user_agent(chrome_win10_ua)
+/* Whether wakeup() interrupts the wait for activity. */
+bool
+HttpExecutor::can_wake() const
 {
-  m_handle = curl_easy_init();
+#ifdef __linux__
+  if (m_epoll_fd != -1)
+    return true;
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074400
+  return true;
+#else
+  return false;
+#endif
 }
 
+/* Interrupt the wait for activity, from any thread. */
 void
-HttpRequest::set_cert(const std::string &cert, const std::string &key)
+HttpExecutor::wakeup()
 {
-  curl_easy_setopt(m_handle, CURLOPT_SSLCERT, cert.c_str());
-  curl_easy_setopt(m_handle, CURLOPT_SSLKEY, key.c_str());
+#ifdef __linux__
+  if (m_epoll_fd != -1) {
+    uint64_t one = 1;
+    if (write(m_wake_fd, &one, sizeof(one)) < 0) {
+      /* Already signalled, the counter is full. */
+    }
+    return;
+  }
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074400
+  curl_multi_wakeup(m_multi_handle);
+#endif
 }
 
 void
-HttpRequest::set_basic_auth(const std::string &user, const std::string &pass)
+HttpExecutor::detach(HttpRequest *req)
 {
-  curl_easy_setopt(m_handle, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
-  curl_easy_setopt(m_handle, CURLOPT_USERNAME, user.c_str());
-  curl_easy_setopt(m_handle, CURLOPT_PASSWORD, pass.c_str());
+  curl_multi_remove_handle(m_multi_handle, req->m_handle);
+  m_active.erase(req);
+
+  if (req->m_limited)
+    m_queued_active--;
 }
 
-void HttpRequest::set_ntlm(const std::string &username, const std::string& password)
+/* Connection level failures that another attempt may not run into. */
+static bool
+is_transient(CURLcode result)
 {
-  curl_easy_setopt(m_handle, CURLOPT_HTTPAUTH, CURLAUTH_NTLM);
-  curl_easy_setopt(m_handle, CURLOPT_USERNAME, username.c_str());
-  curl_easy_setopt(m_handle, CURLOPT_PASSWORD, password.c_str());
+  switch (result) {
+  case CURLE_COULDNT_CONNECT:
+  case CURLE_SEND_ERROR:
+  case CURLE_RECV_ERROR:
+  case CURLE_PARTIAL_FILE:
+  case CURLE_GOT_NOTHING:
+  case CURLE_HTTP2:
+  case CURLE_HTTP2_STREAM:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* Decide whether a finished transfer gets another attempt, and schedule
+ * it. Throttling responses qualify, and idempotent transfers that stalled or
+ * lost their connection. */
+bool
+HttpExecutor::retry(HttpRequest *req, CURLcode result, long status_code)
+{
+  double delay = (double)(1 << (req->m_attempts < 5 ? req->m_attempts : 5));
+
+  if (result == CURLE_OK && is_throttled(status_code)) {
+    m_stats.throttled++;
+    if (req->m_attempts >= req->m_max_retries)
+      return false;
+
+    /* Older curl cannot tell, these retries get the exponential delay. */
+#if LIBCURL_VERSION_NUM >= 0x074200
+    curl_off_t retry_after = 0;
+    curl_easy_getinfo(req->m_handle, CURLINFO_RETRY_AFTER, &retry_after);
+    if (retry_after > 0) {
+      /* Applies to the whole server, not only this request. */
+      delay = (double)retry_after;
+      m_resume_at = now_seconds() + delay;
+    }
+#endif
+    log_tmsg(0, "Server returned %ld for %s, retrying in %.0f seconds",
+        status_code, req->m_url.c_str(), delay);
+  } else if (result == CURLE_OPERATION_TIMEDOUT && req->m_idempotent &&
+      req->m_timeout == 0 && stall_timeout(req) > 0) {
+    m_stats.stalls++;
+    if (req->m_attempts >= req->m_max_retries)
+      return false;
+
+    log_tmsg(0, "Transfer of %s stalled, retrying in %.0f seconds",
+        req->m_url.c_str(), delay);
+  } else if (result == CURLE_OK && status_code == 416 &&
+      req->m_range_from > 0) {
+    if (req->m_attempts >= req->m_max_retries)
+      return false;
+
+    /* The partial file does not fit the file on the server. */
+    log_tmsg(0, "Unable to resume %s, downloading it again",
+        req->m_url.c_str());
+    req->truncate_file();
+    delay = 0;
+  } else if (req->m_idempotent && is_transient(result)) {
+    if (req->m_attempts >= req->m_max_retries)
+      return false;
+
+    log_tmsg(0, "Transfer of %s failed (%s), retrying in %.0f seconds",
+        req->m_url.c_str(), curl_easy_strerror(result), delay);
+  } else {
+    return false;
+  }
+
+  m_stats.retries++;
+  schedule_retry(req, delay);
+  return true;
+}
+
+long
+HttpExecutor::stall_timeout(HttpRequest *req) const
+{
+  return req->m_stall_timeout >= 0 ? req->m_stall_timeout : m_stall_timeout;
+}
+
+void
+HttpExecutor::set_hedging(bool enabled, double percentile)
+{
+  m_hedging = enabled;
+  m_hedge_percentile = percentile;
+}
+
+/* Keep the durations of the last successful buffered transfers, and derive
+ * the hedging delay from them. Downloads and streamed listings take as long
+ * as their size, they would only push the percentile up. */
+void
+HttpExecutor::record_latency(double seconds)
+{
+  static const size_t max_samples = 256;
+
+  if (m_latencies.size() < max_samples) {
+    m_latencies.push_back(seconds);
+  } else {
+    m_latencies[m_latency_pos] = seconds;
+    m_latency_pos = (m_latency_pos + 1) % max_samples;
+  }
+
+  /* Too few samples say nothing about the tail. */
+  if (m_latencies.size() < 20 || ++m_latency_updates % 16 != 0)
+    return;
+
+  std::vector<double> sorted(m_latencies);
+  size_t idx = (size_t)(m_hedge_percentile * (sorted.size() - 1));
+  std::nth_element(sorted.begin(), sorted.begin() + idx, sorted.end());
+  m_hedge_delay = sorted[idx];
+}
+
+/* Only buffered requests (metadata) get hedged. A duplicate download
+ * would have to hold the whole file in memory, and double the traffic just
+ * when the link is slow. Streamed bodies cannot be taken back. */
+bool
+HttpExecutor::hedgeable(const HttpRequest *req) const
+{
+  return req->m_idempotent && req->m_primary == NULL && !req->m_hedged &&
+    req->m_ctx.fp == NULL && req->m_ctx.sink == NULL;
+}
+
+/* Send a duplicate of every hedgeable transfer that has been running for
+ * longer than the hedging delay, on another connection. At most a tenth of
+ * the transfers get a duplicate at any time. */
+void
+HttpExecutor::start_hedges()
+{
+  if (!m_hedging || m_hedge_delay <= 0)
+    return;
+
+  size_t max_hedges = (size_t)concurrency() / 10;
+  if (max_hedges < 1)
+    max_hedges = 1;
+
+  double deadline = now_seconds() - m_hedge_delay;
+  std::vector<HttpRequest *> slow;
+  for (HttpRequest *req : m_active) {
+    if (hedgeable(req) && req->m_started <= deadline) {
+      slow.push_back(req);
+    }
+  }
+
+  for (HttpRequest *req : slow) {
+    if (m_hedges_active >= max_hedges)
+      break;
+
+    HttpRequest *hedge = req->duplicate();
+    hedge->m_primary = req;
+    hedge->m_owned = true;
+    hedge->m_max_retries = 0;
+    if (m_multiplex) {
+      /* Otherwise it would share the original's connection. */
+      curl_easy_setopt(hedge->m_handle, CURLOPT_FRESH_CONNECT, 1L);
+    }
+
+    req->m_hedged = true;
+    if (!attach(hedge)) {
+      delete hedge;
+      continue;
+    }
+    req->m_hedge = hedge;
+    m_hedges_active++;
+    m_stats.hedges++;
+  }
+}
+
+/* A duplicate finished. If it succeeded it wins: the original is
+ * cancelled and completes with the duplicate's response. */
+void
+HttpExecutor::finish_hedge(HttpRequest *hedge, CURLcode result)
+{
+  HttpRequest *req = hedge->m_primary;
+  long status_code = 0;
+
+  curl_easy_getinfo(hedge->m_handle, CURLINFO_RESPONSE_CODE, &status_code);
+  if (result != CURLE_OK || status_code < 200 || status_code > 299) {
+    drop_hedge(hedge);
+    return;
+  }
+
+  m_stats.hedge_wins++;
+  detach(req);
+  req->m_hedge = NULL;
+  m_hedges_active--;
+
+  req->adopt_response(*hedge);
+  conclude(req, CURLE_OK, hedge);
+  delete hedge;
+}
+
+void
+HttpExecutor::drop_hedge(HttpRequest *hedge)
+{
+  hedge->m_primary->m_hedge = NULL;
+  m_hedges_active--;
+  delete hedge;
+}
+
+#ifdef __linux__
+bool
+HttpExecutor::set_event_loop(bool enabled)
+{
+  if (enabled == (m_epoll_fd != -1))
+    return true;
+  /* The other threads may be about to wake the loop up. */
+  if (!m_active.empty() || m_closing > 0 || m_decoding > 0)
+    return false;
+
+  if (!enabled) {
+    curl_multi_setopt(m_multi_handle, CURLMOPT_SOCKETFUNCTION, NULL);
+    curl_multi_setopt(m_multi_handle, CURLMOPT_TIMERFUNCTION, NULL);
+    close(m_wake_fd);
+    close(m_timer_fd);
+    close(m_epoll_fd);
+    m_epoll_fd = m_timer_fd = m_wake_fd = -1;
+    return true;
+  }
+
+  m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (m_epoll_fd == -1)
+    return false;
+  m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_timer_fd == -1 || m_wake_fd == -1) {
+    if (m_timer_fd != -1)
+      close(m_timer_fd);
+    if (m_wake_fd != -1)
+      close(m_wake_fd);
+    close(m_epoll_fd);
+    m_epoll_fd = m_timer_fd = m_wake_fd = -1;
+    return false;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = m_timer_fd;
+  epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_timer_fd, &ev);
+  ev.data.fd = m_wake_fd;
+  epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &ev);
+
+  curl_multi_setopt(m_multi_handle, CURLMOPT_SOCKETFUNCTION, socket_cb);
+  curl_multi_setopt(m_multi_handle, CURLMOPT_SOCKETDATA, this);
+  curl_multi_setopt(m_multi_handle, CURLMOPT_TIMERFUNCTION, timer_cb);
+  curl_multi_setopt(m_multi_handle, CURLMOPT_TIMERDATA, this);
+  return true;
+}
+
+/* curl tells us which sockets to watch, and for what. */
+int
+HttpExecutor::socket_cb(CURL *hnd, curl_socket_t s, int what, void *userp,
+    void *socketp)
+{
+  HttpExecutor *executor = static_cast<HttpExecutor *>(userp);
+  struct epoll_event ev;
+
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl(executor->m_epoll_fd, EPOLL_CTL_DEL, s, NULL);
+    return 0;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.data.fd = s;
+  if (what & CURL_POLL_IN)
+    ev.events |= EPOLLIN;
+  if (what & CURL_POLL_OUT)
+    ev.events |= EPOLLOUT;
+
+  if (epoll_ctl(executor->m_epoll_fd, EPOLL_CTL_MOD, s, &ev) == -1 &&
+      errno == ENOENT) {
+    epoll_ctl(executor->m_epoll_fd, EPOLL_CTL_ADD, s, &ev);
+  }
+  return 0;
+}
+
+/* curl asks to be called back after timeout_ms, -1 cancels the timer. */
+int
+HttpExecutor::timer_cb(CURLM *multi, long timeout_ms, void *userp)
+{
+  HttpExecutor *executor = static_cast<HttpExecutor *>(userp);
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if (timeout_ms > 0) {
+    its.it_value.tv_sec = timeout_ms / 1000;
+    its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+  } else if (timeout_ms == 0) {
+    /* An all zero it_value disarms the timer, expire right away instead. */
+    its.it_value.tv_nsec = 1;
+  }
+  timerfd_settime(executor->m_timer_fd, 0, &its, NULL);
+  return 0;
+}
+
+CURLMcode
+HttpExecutor::wait_events()
+{
+  struct epoll_event events[64];
+  CURLMcode mcode = CURLM_OK;
+  int still_running = 0;
+  int n;
+
+  /* curl's timeouts arrive through the timerfd; the executor's own
+   * deadlines (delayed retries) bound the wait. */
+  n = epoll_wait(m_epoll_fd, events, 64, (int)wait_timeout(1000));
+  if (n == -1)
+    return errno == EINTR ? CURLM_OK : CURLM_INTERNAL_ERROR;
+
+  for (int i = 0; i < n && mcode == CURLM_OK; i++) {
+    if (events[i].data.fd == m_wake_fd) {
+      /* Another thread has something for step() to pick up. */
+      uint64_t wakeups;
+      if (read(m_wake_fd, &wakeups, sizeof(wakeups)) < 0) {
+        /* Nothing to do, the eventfd is non-blocking. */
+      }
+      continue;
+    }
+    if (events[i].data.fd == m_timer_fd) {
+      uint64_t expirations;
+      if (read(m_timer_fd, &expirations, sizeof(expirations)) < 0) {
+        /* Nothing to do, the timer is non-blocking. */
+      }
+      mcode = curl_multi_socket_action(m_multi_handle, CURL_SOCKET_TIMEOUT, 0,
+          &still_running);
+      continue;
+    }
+
+    int mask = 0;
+    if (events[i].events & EPOLLIN)
+      mask |= CURL_CSELECT_IN;
+    if (events[i].events & EPOLLOUT)
+      mask |= CURL_CSELECT_OUT;
+    if (events[i].events & (EPOLLERR | EPOLLHUP))
+      mask |= CURL_CSELECT_ERR;
+    mcode = curl_multi_socket_action(m_multi_handle, events[i].data.fd, mask,
+        &still_running);
+  }
+
+  return mcode;
+}
+#else
+bool
+HttpExecutor::set_event_loop(bool enabled)
+{
+  return !enabled;
+}
+#endif
+
+CURLMcode
+HttpExecutor::wait_poll()
+{
+  CURLMcode mcode;
+  int still_running = 0;
+  int rc;
+  long timeout = wait_timeout(1000);
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+  /* Unlike curl_multi_wait(), this also waits without any transfer, and
+   * returns early on wakeup(). */
+  mcode = curl_multi_poll(m_multi_handle, NULL, 0, (int)timeout, &rc);
+  if (mcode == CURLM_OK)
+    mcode = curl_multi_perform(m_multi_handle, &still_running);
+  return mcode;
+#else
+  if (m_active.empty()) {
+    /* Only delayed retries left, curl has nothing to wait on. */
+    WAITMS(timeout);
+    return CURLM_OK;
+  }
+
+  mcode = curl_multi_wait(m_multi_handle, NULL, 0, (int)timeout, &rc);
+
+  if (mcode == CURLM_OK) {
+    if (rc == 0) {
+      long sleep_ms;
+
+      /* If it returns without any file descriptor instantly, we need to
+       * avoid busy looping during periods where it has nothing particular
+       * to wait for. */
+      curl_multi_timeout(m_multi_handle, &sleep_ms);
+      if (sleep_ms < 0 || sleep_ms > timeout)
+        sleep_ms = timeout;
+      if (sleep_ms) {
+        WAITMS(sleep_ms);
+
+      }
+    }
+
+    mcode = curl_multi_perform(m_multi_handle, &still_running);
+  }
+
+  return mcode;
+#endif
+}
+
+void
+HttpExecutor::step()
+{
+  CURLMcode mcode;
+  int rc;
+
+#ifdef __linux__
+  if (m_epoll_fd != -1)
+    mcode = wait_events();
+  else
+#endif
+    mcode = wait_poll();
+
+  if (mcode != CURLM_OK) {
+    /* The multi handle is unusable, fail everything that is in flight. */
+    CURLcode result = (mcode == CURLM_OUT_OF_MEMORY) ?
+      CURLE_OUT_OF_MEMORY : CURLE_BAD_FUNCTION_ARGUMENT;
+    while (!m_active.empty()) {
+      finish((*m_active.begin())->m_handle, result);
+    }
+    return;
+  }
+
+  CURLMsg *msg;
+  while ((msg = curl_multi_info_read(m_multi_handle, &rc)) != NULL) {
+    if (msg->msg == CURLMSG_DONE) {
+      finish(msg->easy_handle, msg->data.result);
+    }
+  }
+
+  collect_closed();
+  collect_decoded();
+  resume_paused();
+  start_delayed();
+  start_queued();
+  start_hedges();
+}
+
+CURLcode
+HttpExecutor::perform(HttpRequest *req)
+{
+  req->m_owned = false;
+  if (!attach(req)) {
+    return req->m_result;
+  }
+
+  while (!req->m_done) {
+    step();
+  }
+
+  return req->m_result;
+}
+
+void
+HttpExecutor::drain(size_t limit)
+{
+  while (pending() > limit) {
+    step();
+  }
+}
+
+void
+HttpExecutor::poll()
+{
+  step();
+}
+
+void HttpRequest::set_content(const char *content_type)
+{
+  std::string ctype_hdr = "Content-Type: ";
+  ctype_hdr.append(content_type);
+  m_headers = curl_slist_append(m_headers, ctype_hdr.c_str());
+}
+
+/* Options shared by every kind of transfer. */
+void
+HttpRequest::prepare_common()
+{
+  curl_easy_setopt(m_handle, CURLOPT_URL, m_url.c_str());
+  curl_easy_setopt(m_handle, CURLOPT_HTTPHEADER, m_headers);
+  curl_easy_setopt(m_handle, CURLOPT_USERAGENT, m_user_agent.c_str());
+
+  m_ctx.fp = NULL;
+  m_ctx.range_from = 0;
+  m_ctx.writer = NULL;
+  m_ctx.paused = false;
+  reset_response();
+  curl_easy_setopt(m_handle, CURLOPT_HEADERFUNCTION, dk_httpheader);
+  curl_easy_setopt(m_handle, CURLOPT_HEADERDATA, &m_ctx);
+}
+
+void
+HttpRequest::reset_response()
+{
+  m_resp = HttpResponse();
+  m_resp.status_code = 0;
+  m_resp.elapsed = 0;
+  m_ctx.resp = &m_resp;
+  m_ctx.req = this;
+  m_ctx.auth_challenges = 0;
+  m_ctx.status_code = 0;
+  m_ctx.body_bytes = 0;
+}
+
+void
+HttpRequest::prepare(const char *method, const char *data)
+{
+  m_idempotent = strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0;
+
+  if (strcmp(method, "GET") == 0) {
+    curl_easy_setopt(m_handle, CURLOPT_HTTPGET, 1);
+  } else if (strcmp(method, "HEAD") == 0) {
+    curl_easy_setopt(m_handle, CURLOPT_NOBODY, 1);
+  } else if (strcmp(method, "POST") == 0) {
+    curl_easy_setopt(m_handle, CURLOPT_POST, 1);
+  } else {
+    curl_easy_setopt(m_handle, CURLOPT_CUSTOMREQUEST, method);
+  }
+
+  if (data != NULL) {
+    /* Copied, asynchronous requests outlive the caller's buffer. */
+    curl_easy_setopt(m_handle, CURLOPT_POSTFIELDSIZE, (long)strlen(data));
+    curl_easy_setopt(m_handle, CURLOPT_COPYPOSTFIELDS, data);
+  } else {
+    curl_easy_setopt(m_handle, CURLOPT_POSTFIELDSIZE, 0);
+  }
+
+  prepare_common();
+
+  curl_easy_setopt(m_handle, CURLOPT_DEBUGFUNCTION, curl_debug_func);
+  curl_easy_setopt(m_handle, CURLOPT_DEBUGDATA, &m_ctx);
+  curl_easy_setopt(m_handle, CURLOPT_VERBOSE, 1);
+
+	curl_easy_setopt(m_handle, CURLOPT_FAILONERROR, 0);
+
+	/* Verification of SSL is disabled on Windows. This is a limitation of
+	 * curl */
+	curl_easy_setopt(m_handle, CURLOPT_SSL_VERIFYHOST, 0);
+	curl_easy_setopt(m_handle, CURLOPT_SSL_VERIFYPEER, 0);
+	curl_easy_setopt(m_handle, CURLOPT_WRITEDATA, &m_ctx);
+	curl_easy_setopt(m_handle, CURLOPT_WRITEFUNCTION, dk_httpread);
+}
+
+HttpResponse HttpRequest::exec(const char *method, const char *data)
+{
+  prepare(method, data);
+  m_executor.perform(this);
+
+  return m_resp;
+}
+
+void
+HttpRequest::exec_async(const char *method, const char *data,
+    HttpCallback cb)
+{
+  prepare(method, data);
+  m_callback = cb;
+  m_executor.add(this);
+}
+
+/* Called by the executor once the transfer has been removed from the multi
+ * handle. source is the request whose transfer produced the response, which
+ * is a hedge if that one won. */
+void
+HttpRequest::complete(CURLcode result, HttpRequest *source)
+{
+  record(result, source);
+  notify();
+}
+
+/* Keep the outcome of the transfer, while its handle can still tell. */
+void
+HttpRequest::record(CURLcode result, HttpRequest *source)
+{
+  if (source == NULL)
+    source = this;
+
+  m_result = result;
+
+  if (result != CURLE_OK) {
+    log_tmsg(0, "Failure performing request");
+  }
+  curl_easy_getinfo(source->m_handle, CURLINFO_RESPONSE_CODE,
+      &m_resp.status_code);
+  curl_easy_getinfo(source->m_handle, CURLINFO_TOTAL_TIME, &elapsed);
+  m_resp.elapsed = elapsed;
+}
+
+/* Close the file, if any, and run the callback. */
+void
+HttpRequest::notify()
+{
+  if (m_fp != NULL) {
+    if (m_ctx.writer != NULL)
+      m_ctx.writer->sync();
+    fclose(m_fp);
+    m_fp = NULL;
+  }
+
+  m_done = true;
+  if (m_callback) {
+    m_callback(*this);
+  }
+}
+
+/* Size of the file, leaving the position at its end. */
+static curl_off_t
+file_end(FILE *fp)
+{
+  fflush(fp);
+#ifdef _WIN32
+  _fseeki64(fp, 0, SEEK_END);
+  return _ftelli64(fp);
+#else
+  fseeko(fp, 0, SEEK_END);
+  return ftello(fp);
+#endif
+}
+
+/* Cut the file down to size bytes and continue writing there. */
+static bool
+truncate_fp(FILE *fp, curl_off_t size)
+{
+  bool ok;
+
+  fflush(fp);
+#ifdef _WIN32
+  ok = _chsize_s(_fileno(fp), size) == 0;
+  _fseeki64(fp, size, SEEK_SET);
+#else
+  ok = ftruncate(fileno(fp), size) == 0;
+  fseeko(fp, size, SEEK_SET);
+#endif
+  return ok;
+}
+
+/* Drop what earlier attempts wrote after the first size bytes. */
+void
+HttpRequest::truncate_file(curl_off_t size)
+{
+  if (m_ctx.fp == NULL)
+    return;
+
+  if (m_ctx.writer != NULL)
+    m_ctx.writer->sync();
+  if (!truncate_fp(m_ctx.fp, size)) {
+    log_tmsg(0, "Unable to truncate download of %s", m_url.c_str());
+  }
+}
+
+/* Get a file transfer ready for another attempt, which continues after the
+ * bytes already written. */
+void
+HttpRequest::rewind_file()
+{
+  if (m_ctx.fp == NULL)
+    return;
+
+  if (m_ctx.writer != NULL)
+    m_ctx.writer->sync();
+  set_range(file_end(m_ctx.fp));
+}
+
+/* Request the body from offset on, or all of it for 0. */
+void
+HttpRequest::set_range(curl_off_t offset)
+{
+  m_range_from = offset;
+  m_ctx.range_from = offset;
+
+  if (offset > 0) {
+    char range[32];
+    snprintf(range, sizeof(range), "%" CURL_FORMAT_CURL_OFF_T "-", offset);
+    curl_easy_setopt(m_handle, CURLOPT_RANGE, range);
+  } else {
+    curl_easy_setopt(m_handle, CURLOPT_RANGE, NULL);
+  }
+}
+
+/* A hedge copy of this request won, take over what it received. */
+void
+HttpRequest::adopt_response(HttpRequest &other)
+{
+  m_resp.headers.swap(other.m_resp.headers);
+  m_resp.body.swap(other.m_resp.body);
+  m_ctx.body_bytes = other.m_ctx.body_bytes;
+}
+
+/* Copy of this (buffered) request for hedging: same options on a new easy
+ * handle. */
+HttpRequest *
+HttpRequest::duplicate()
+{
+  HttpRequest *dup = new HttpRequest(m_url, m_verbose, m_executor,
+      curl_easy_duphandle(m_handle));
+
+  dup->m_conn_auth = m_conn_auth;
+  dup->m_idempotent = m_idempotent;
+  dup->m_ctx.max_body = m_ctx.max_body;
+  dup->reset_response();
+
+  curl_easy_setopt(dup->m_handle, CURLOPT_WRITEFUNCTION, dk_httpread);
+  curl_easy_setopt(dup->m_handle, CURLOPT_WRITEDATA, &dup->m_ctx);
+  curl_easy_setopt(dup->m_handle, CURLOPT_HEADERDATA, &dup->m_ctx);
+  curl_easy_setopt(dup->m_handle, CURLOPT_DEBUGDATA, &dup->m_ctx);
+  return dup;
+}
+
+/* Value of the last header called name, empty if there is none. */
+std::string
+HttpResponse::header(const char *name) const
+{
+  size_t len = strlen(name);
+
+  for (auto it = headers.rbegin(); it != headers.rend(); ++it) {
+    if (it->size() > len && (*it)[len] == ':' &&
+        curl_strnequal(it->c_str(), name, len)) {
+      size_t start = it->find_first_not_of(" \t", len + 1);
+      return start == std::string::npos ? std::string() : it->substr(start);
+    }
+  }
+  return std::string();
+}
+
+void
+HttpRequest::set_stall_timeout(long seconds)
+{
+  m_stall_timeout = seconds;
+}
+
+void
+HttpRequest::set_timeout(long seconds)
+{
+  m_timeout = seconds;
+  curl_easy_setopt(m_handle, CURLOPT_TIMEOUT, seconds);
+}
+
+void
+HttpRequest::set_max_body(curl_off_t bytes)
+{
+  m_ctx.max_body = bytes;
+}
+
+void
+HttpRequest::set_body_sink(BodySink *sink)
+{
+  m_ctx.sink = sink;
+}
+
+static size_t
+write_file(void *ptr, size_t size, size_t nmemb, http_context *ctx)
+{
+  /* Error pages (and throttling responses that will be retried) are kept
+   * in the response body for logging, never written to the file. */
+  if (ctx->status_code < 200 || ctx->status_code > 299) {
+    ctx->resp->body.append((char *)ptr, size * nmemb);
+    return nmemb;
+  }
+
+  if (ctx->range_from > 0 && ctx->status_code != 206) {
+    /* The server sends the whole file after all (If-Range did not match
+     * or ranges are not supported). */
+    if (ctx->writer != NULL)
+      ctx->writer->sync();
+    truncate_fp(ctx->fp, 0);
+    ctx->range_from = 0;
+  }
+
+  if (ctx->writer != NULL) {
+    if (!ctx->writer->write(ctx->fp, (const char *)ptr, size * nmemb)) {
+      /* The disk is behind. The executor resumes the transfer once the
+       * writer has caught up, curl then passes the same data again. */
+      ctx->paused = true;
+      ctx->stats->write_pauses++;
+      return CURL_WRITEFUNC_PAUSE;
+    }
+    ctx->body_bytes += size * nmemb;
+    return nmemb;
+  }
+
+  size_t written = fwrite(ptr, size, nmemb, ctx->fp);
+  ctx->body_bytes += written * size;
+  return written;
+}
+
+bool
+HttpRequest::get_file(const char *file)
+{
+  FILE *fp;
+
+  fp = fopen(file, "w");
+  if (fp == NULL) {
+    return false;
+  }
+
+  bool ret = get_file_fp(fp);
+
+  fclose(fp);
+  return ret;
+}
+
+bool
+HttpRequest::get_file_async(const char *file, HttpCallback cb)
+{
+  m_fp = fopen(file, "w");
+  if (m_fp == NULL) {
+    return false;
+  }
+
+  prepare_file(m_fp);
+  m_ctx.writer = m_executor.file_writer();
+  m_callback = cb;
+  m_executor.add(this);
+  return true;
+}
+
+bool
+HttpRequest::resume_file_async(const char *file, const std::string &if_range,
+    HttpCallback cb)
+{
+  m_fp = fopen(file, "r+b");
+  if (m_fp == NULL && errno == ENOENT)
+    m_fp = fopen(file, "w+b");
+  if (m_fp == NULL) {
+    return false;
+  }
+
+  curl_off_t size = file_end(m_fp);
+
+  /* If-Range only takes strong validators. */
+  if (size > 0 && !if_range.empty() && if_range.compare(0, 2, "W/") != 0) {
+    add_header("If-Range", if_range.c_str());
+  }
+
+  prepare_file(m_fp);
+  m_ctx.writer = m_executor.file_writer();
+  set_range(size);
+  m_callback = cb;
+  m_executor.add(this);
+  return true;
+}
+
+void
+HttpRequest::prepare_file(FILE *fp)
+{
+  curl_easy_setopt(m_handle, CURLOPT_HTTPGET, 1);
+  curl_easy_setopt(m_handle, CURLOPT_POSTFIELDSIZE, 0);
+  m_idempotent = true;
+
+  prepare_common();
+
+  curl_easy_setopt(m_handle, CURLOPT_FAILONERROR, 0);
+
+  m_ctx.fp = fp;
+  curl_easy_setopt(m_handle, CURLOPT_WRITEDATA, &m_ctx);
+  curl_easy_setopt(m_handle, CURLOPT_WRITEFUNCTION, write_file);
+  curl_easy_setopt(m_handle, CURLOPT_FOLLOWLOCATION, 1L);
+}
+
+bool
+HttpRequest::get_file_fp(FILE *fp)
+{
+  prepare_file(fp);
+  m_executor.perform(this);
+
+  return m_result == CURLE_OK && m_resp.status_code >= 200 &&
+    m_resp.status_code <= 299;
+}
+
+HttpRequest::HttpRequest(const std::string &url, bool verbose,
+    HttpExecutor& executor) :
+  HttpRequest(url, verbose, executor, executor.acquire_handle())
+{
+}
+
+HttpRequest::HttpRequest(const std::string &url, bool verbose,
+    HttpExecutor& executor, CURL *handle) :
+  m_executor(executor), m_handle(handle), m_headers(NULL), m_url(url), m_verbose(verbose),
+  m_user_agent(chrome_win10_ua), m_fp(NULL), m_result(CURLE_OK),
+  m_done(false), m_owned(false), m_limited(false), m_conn_auth(false),
+  m_attempts(0), m_max_retries(5), m_started(0), m_stall_timeout(-1),
+  m_idempotent(false), m_primary(NULL), m_hedge(NULL), m_hedged(false),
+  m_range_from(0), m_timeout(0)
+{
+  memset(&m_ctx, 0, sizeof(m_ctx));
+}
+
+void
+HttpRequest::set_cert(const std::string &cert, const std::string &key)
+{
+  curl_easy_setopt(m_handle, CURLOPT_SSLCERT, cert.c_str());
+  curl_easy_setopt(m_handle, CURLOPT_SSLKEY, key.c_str());
+}
+
+void
+HttpRequest::set_basic_auth(const std::string &user, const std::string &pass)
+{
+  curl_easy_setopt(m_handle, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+  curl_easy_setopt(m_handle, CURLOPT_USERNAME, user.c_str());
+  curl_easy_setopt(m_handle, CURLOPT_PASSWORD, pass.c_str());
+  m_conn_auth = false;
+}
+
+void HttpRequest::set_ntlm(const std::string &username, const std::string& password)
+{
+  curl_easy_setopt(m_handle, CURLOPT_HTTPAUTH, CURLAUTH_NTLM);
+  curl_easy_setopt(m_handle, CURLOPT_USERNAME, username.c_str());
+  curl_easy_setopt(m_handle, CURLOPT_PASSWORD, password.c_str());
+  m_conn_auth = true;
+}
+
+/* Credentials come from the Kerberos ticket cache, curl only needs a blank
+ * user name to enable GSS-API. */
+void
+HttpRequest::set_negotiate()
+{
+  curl_easy_setopt(m_handle, CURLOPT_HTTPAUTH, CURLAUTH_NEGOTIATE);
+  curl_easy_setopt(m_handle, CURLOPT_USERPWD, ":");
+  m_conn_auth = true;
+}
+
+void
+HttpRequest::set_auth(AuthScheme scheme, const std::string &user,
+    const std::string &password)
+{
+  switch (scheme) {
+  case AUTH_NTLM:
+    set_ntlm(user, password);
+    break;
+  case AUTH_BASIC:
+    set_basic_auth(user, password);
+    break;
+  case AUTH_PAT:
+    /* Azure DevOps ignores the user name for personal access tokens. */
+    set_basic_auth(user, password);
+    break;
+  case AUTH_NEGOTIATE:
+    set_negotiate();
+    break;
+  }
 }
 
 void
@@ -347,7 +1736,14 @@ HttpRequest::add_header(const char *key, const char *value)
 
 HttpRequest::~HttpRequest()
 {
-  curl_easy_cleanup(m_handle);
+  if (m_fp != NULL)
+    fclose(m_fp);
+  /* Duplicated handles keep state that curl_easy_reset() does not clear,
+   * so they do not go back to the pool. */
+  if (m_primary != NULL)
+    curl_easy_cleanup(m_handle);
+  else
+    m_executor.release_handle(m_handle);
   curl_slist_free_all(m_headers);
 }
 
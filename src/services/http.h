@@ -20,6 +20,10 @@
 /* HTTP Services version 1.102 (06-17-2019) */
 #include <curl/curl.h>
 
+#include <deque>
+#include <functional>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -31,6 +35,51 @@ const int STATUS_NOCONTENT = 204;
 const int STATUS_FORBIDDEN = 403;
 const int STATUS_ERROR = 500;
 
+class DecodePool;
+class FileWriter;
+class HttpRequest;
+
+typedef std::function<void(HttpRequest &)> HttpCallback;
+
+// Authentication strategies, selected with [tfs] auth= in the configuration.
+enum AuthScheme {
+  AUTH_NTLM,      // challenge/response, authenticates a whole connection.
+  AUTH_BASIC,     // username and password sent with every request.
+  AUTH_PAT,       // personal access token, sent as basic auth.
+  AUTH_NEGOTIATE  // Kerberos/SPNEGO, authenticates a whole connection.
+};
+
+// Returns false if name is not a known scheme.
+bool parse_auth_scheme(const std::string &name, AuthScheme &scheme);
+
+// Counters accumulated by an HttpExecutor over its lifetime.
+struct HttpStats {
+  unsigned long requests;         // completed transfers.
+  unsigned long connects;         // new connections opened.
+  unsigned long auth_handshakes;  // transfers that had to answer a 401.
+  unsigned long auth_round_trips; // 401 challenges received.
+  unsigned long auth_reused;      // transfers on an authenticated connection.
+  curl_off_t wire_bytes;          // response bytes as received.
+  curl_off_t body_bytes;          // response bytes after decompression.
+  unsigned long throttled;        // 429 and 503 responses.
+  unsigned long retries;          // requests sent again.
+  unsigned long stalls;           // transfers aborted by the stall timeout.
+  unsigned long hedges;           // duplicate requests sent.
+  unsigned long hedge_wins;       // duplicates that answered first.
+  unsigned long write_pauses;     // downloads paused for the writer thread.
+};
+
+/*
+ * Drives any number of HttpRequests on a single curl multi handle.
+ *
+ * Blocking calls (HttpRequest::exec, get_file) and queued asynchronous
+ * requests share the same executor, so a blocking call keeps servicing the
+ * queued transfers while it waits for its own.
+ *
+ * The executor also owns a pool of curl easy handles and a share object
+ * (DNS, TLS sessions and the connection cache), so requests made through it
+ * reuse warm connections instead of setting up a new one each time.
+ */
 class HttpExecutor {
 public:
   HttpExecutor();
@@ -43,8 +92,175 @@ public:
 
   CURLM* handle() { return m_multi_handle; }
 
+  // Number of queued requests that may be in flight at once. Blocking
+  // requests are not counted against this limit.
+  void set_max_transfers(int max_transfers);
+  int max_transfers() const { return m_max_transfers; }
+
+  // Let the number of queued transfers in flight float between 1 and
+  // max_transfers: grow it while the time to first byte stays flat, halve it
+  // on 429/503 responses or when latency climbs. Throttled requests are
+  // retried regardless, after Retry-After if the server sent one.
+  void set_adaptive(bool enabled);
+  int concurrency() const;
+
+  // Abort and retry idempotent transfers that receive nothing for that many
+  // seconds; 0 disables. Requests can override it with set_stall_timeout().
+  void set_stall_timeout(long seconds) { m_stall_timeout = seconds; }
+
+  // Once a buffered GET has run longer than the given percentile of recent
+  // ones, send a duplicate on another connection and keep whichever
+  // response arrives first. File downloads and streamed bodies are never
+  // duplicated.
+  void set_hedging(bool enabled, double percentile = 0.95);
+
+  // Queue a prepared request. The executor takes ownership of the request
+  // and deletes it after its completion callback has run.
+  void add(HttpRequest *req);
+
+  // Open and authenticate connections to url in the background, so later
+  // requests find them warm. configure applies the credentials.
+  void prewarm(const std::string &url, int connections,
+      const HttpCallback &configure);
+
+  // Run a prepared request to completion, servicing other transfers while
+  // waiting.
+  CURLcode perform(HttpRequest *req);
+
+  // Service transfers until no more than limit requests are outstanding.
+  void drain(size_t limit);
+  void run() { drain(0); }
+
+  // Wait for activity once, running the callbacks of the requests that
+  // completed in the meantime.
+  void poll();
+
+  size_t pending() const {
+    return m_queue.size() + m_active.size() + m_delayed.size() + m_closing +
+      m_decoding;
+  }
+
+  // Hand the data of asynchronous downloads to a writer thread, holding
+  // at most max_bytes of it (0 writes from the transfers, the default).
+  // Transfers that would exceed the limit are paused until the writer has
+  // caught up. Can only be changed while nothing is in flight.
+  bool set_write_queue(size_t max_bytes);
+  FileWriter *file_writer() const { return m_writer; }
+
+  // Parse response bodies on that many threads of their own (0 parses on
+  // the thread running the executor, the default), so that large bodies do
+  // not hold up the other transfers. Can only be changed while nothing is
+  // being decoded.
+  bool set_decode_threads(int threads);
+
+  // Run work on a decode thread, then done on this one from within poll()
+  // and friends. done counts as pending until it has run. Without decode
+  // threads, or with nothing else in flight to hold up, both run right
+  // away. work must not touch the executor.
+  void decode(const std::function<void()> &work,
+      const std::function<void()> &done);
+
+  // Negotiate HTTP/2 and multiplex transfers over shared connections, with
+  // at most max_streams concurrent streams per connection (0 keeps curl's
+  // default). NTLM and Negotiate authenticated transfers stay on HTTP/1.1.
+  void set_multiplex(bool enabled, long max_streams = 0);
+
+  // Offer gzip/deflate (and whatever else curl can decode) on every request
+  // and decode responses transparently. On by default; returns false if
+  // curl was built without zlib.
+  bool set_compression(bool enabled);
+
+  // Drive transfers with curl_multi_socket_action() from an epoll loop with
+  // a timerfd for curl's timeouts, instead of curl_multi_wait(). Only
+  // available on Linux, and only while no transfer is running.
+  bool set_event_loop(bool enabled);
+
+  // Borrow an easy handle from the pool, and give it back once done.
+  CURL *acquire_handle();
+  void release_handle(CURL *hnd);
+
+  const HttpStats& stats() const { return m_stats; }
+
 private:
+  HttpExecutor(const HttpExecutor &); // avoid copy constructor
+
+  void account(HttpRequest *req);
+  static int close_socket(void *clientp, curl_socket_t item);
+
+  bool attach(HttpRequest *req);
+  void detach(HttpRequest *req);
+  bool retry(HttpRequest *req, CURLcode result, long status_code);
+  long stall_timeout(HttpRequest *req) const;
+  void record_latency(double seconds);
+  bool hedgeable(const HttpRequest *req) const;
+  void start_hedges();
+  void finish_hedge(HttpRequest *hedge, CURLcode result);
+  void conclude(HttpRequest *req, CURLcode result, HttpRequest *source = NULL);
+  void collect_closed();
+  void collect_decoded();
+  void resume_paused();
+  void drop_hedge(HttpRequest *hedge);
+  void adapt(HttpRequest *req, CURLcode result, long status_code);
+  void schedule_retry(HttpRequest *req, double delay);
+  void start_delayed();
+  long wait_timeout(long cap);
+  bool can_wake() const;
+  void wakeup();
+  void start_queued();
+  void step();
+  CURLMcode wait_poll();
+#ifdef __linux__
+  CURLMcode wait_events();
+  static int socket_cb(CURL *hnd, curl_socket_t s, int what, void *userp,
+      void *socketp);
+  static int timer_cb(CURLM *multi, long timeout_ms, void *userp);
+#endif
+  void finish(CURL *hnd, CURLcode result);
+
   CURLM* m_multi_handle;
+  CURLSH* m_share_handle;
+  std::vector<CURL *> m_idle_handles;
+  std::deque<HttpRequest *> m_queue;
+  std::set<HttpRequest *> m_active;
+  std::multimap<double, HttpRequest *> m_delayed; // retries, by due time.
+  size_t m_queued_active; // active requests that came from m_queue.
+  int m_max_transfers;
+  bool m_multiplex;
+  bool m_compression;
+  double m_resume_at; // no queued transfer starts before this (Retry-After).
+
+  // Adaptive concurrency state, see set_adaptive().
+  bool m_adaptive;
+  double m_window;
+  double m_min_latency;
+  double m_latency;
+  double m_last_decrease;
+
+  long m_stall_timeout;
+
+  // Hedging state, see set_hedging().
+  bool m_hedging;
+  double m_hedge_percentile;
+  double m_hedge_delay; // 0 until enough transfers have completed.
+  size_t m_hedges_active;
+  std::vector<double> m_latencies;
+  size_t m_latency_pos;
+  unsigned long m_latency_updates;
+
+  FileWriter *m_writer;
+  size_t m_closing; // downloads waiting for the writer to close their file.
+  DecodePool *m_decoder;
+  size_t m_decoding; // decode jobs whose done has not run yet.
+#ifdef __linux__
+  int m_epoll_fd; // -1 unless the event loop is enabled.
+  int m_timer_fd;
+  int m_wake_fd;  // eventfd the other threads wake the loop up with.
+#endif
+
+  // Connections that completed a connection based (NTLM/Negotiate)
+  // handshake, keyed by socket. Entries are dropped when curl closes them.
+  std::set<curl_socket_t> m_authenticated;
+  HttpStats m_stats;
 };
 
 /*
@@ -56,11 +272,45 @@ public:
   std::vector<std::string> headers;
   long status_code;
   double elapsed;
+
+  std::string header(const char *name) const;
+};
+
+/*
+ * Receives the body of a successful (2xx) response as it arrives, instead
+ * of having it buffered in HttpResponse::body. Error responses are still
+ * buffered, so they can be logged.
+ */
+class BodySink {
+public:
+  virtual ~BodySink() {}
+
+  // Returning false aborts the transfer with CURLE_WRITE_ERROR.
+  virtual bool write(const char *data, size_t len) = 0;
+
+  // The request is about to be sent again, the body starts over.
+  virtual void restart() = 0;
+};
+
+struct http_context {
+  HttpRequest *req;
+  HttpResponse *resp;
+  int auth_challenges; // 401 responses seen during this transfer.
+  long status_code;    // status of the response being received.
+  FILE *fp;            // destination of file transfers.
+  curl_off_t body_bytes; // decoded bytes handed to the write callback.
+  curl_off_t range_from; // file offset the body starts at, while resuming.
+  curl_off_t max_body; // buffered responses beyond this abort, 0 for no limit.
+  FileWriter *writer;  // writes file transfers when set.
+  BodySink *sink;      // receives 2xx bodies of buffered transfers when set.
+  HttpStats *stats;    // of the executor running the transfer.
+  bool paused;         // transfer paused until the writer has room.
 };
 
 class HttpRequest {
 public:
-  HttpRequest(const std::string &url, bool verbose = false);
+  HttpRequest(const std::string &url, bool verbose = false,
+      HttpExecutor& executor = HttpExecutor::default_instance());
   ~HttpRequest();
 
   void add_header(const char *key, const char *value);
@@ -69,27 +319,100 @@ public:
   // Authorization schemes
   void set_ntlm(const std::string &username, const std::string &password);
   void set_basic_auth(const std::string &user, const std::string &password);
+  void set_negotiate();
+  void set_auth(AuthScheme scheme, const std::string &user,
+      const std::string &password);
 
   bool get_file(const char *file);
   bool get_file_fp(FILE *fp);
 
   void set_content(const char *content_type);
-  HttpResponse exec(const char *method, const char *data,
-      HttpExecutor& executor = HttpExecutor::default_instance());
+  HttpResponse exec(const char *method, const char *data);
   bool verbose() { return m_verbose; }
 
+  // Asynchronous variants of exec() and get_file(). The request must be
+  // allocated with new; the executor owns it from here on and deletes it
+  // once the callback has returned.
+  void exec_async(const char *method, const char *data, HttpCallback cb);
+  bool get_file_async(const char *file, HttpCallback cb);
+
+  // Like get_file_async(), but keeps what file already holds and only asks
+  // for the rest. With if_range (an ETag) the server sends the whole file
+  // instead when it no longer matches. File transfers that get retried
+  // always continue where the failed attempt stopped.
+  bool resume_file_async(const char *file, const std::string &if_range,
+      HttpCallback cb);
+
+  // Outcome of the last transfer, valid once it has completed.
+  CURLcode result() const { return m_result; }
+  const HttpResponse& response() const { return m_resp; }
+  HttpResponse& response() { return m_resp; }
+  const std::string& url() const { return m_url; }
+
+  // Overrides HttpExecutor::set_stall_timeout() for this request.
+  void set_stall_timeout(long seconds);
+
+  // Give up on the transfer after that many seconds, or once the buffered
+  // body grows beyond bytes. The request then fails with
+  // CURLE_OPERATION_TIMEDOUT or CURLE_WRITE_ERROR and is not retried.
+  void set_timeout(long seconds);
+  void set_max_body(curl_off_t bytes);
+
+  // Stream the body of exec() and exec_async() to sink rather than
+  // buffering it. The sink must outlive the request. Streamed requests are
+  // retried (the sink is restarted) but never hedged.
+  void set_body_sink(BodySink *sink);
+
   std::string resp_body;
   std::string req_hdrs;
   std::vector<std::string> resp_hdrs;
   double elapsed;
 private:
+  friend class HttpExecutor;
+
   HttpRequest(const HttpRequest &); // avoid copy constructor
+  HttpRequest(const std::string &url, bool verbose, HttpExecutor& executor,
+      CURL *handle);
+
+  void prepare_common();
+  void reset_response();
+  void truncate_file(curl_off_t size = 0);
+  void rewind_file();
+  void set_range(curl_off_t offset);
+  void adopt_response(HttpRequest &other);
+  HttpRequest *duplicate();
+  void prepare(const char *method, const char *data);
+  void prepare_file(FILE *fp);
+  void complete(CURLcode result, HttpRequest *source = NULL);
+  void record(CURLcode result, HttpRequest *source);
+  void notify();
 
-  CURL *m_handle; // curl easy handle.
+  HttpExecutor& m_executor;
+  CURL *m_handle; // curl easy handle, borrowed from m_executor.
   curl_slist *m_headers; // Curl headers to append to request.
   std::string m_url;
   bool m_verbose;
   std::string m_user_agent;
+
+  http_context m_ctx;
+  HttpResponse m_resp;
+  HttpCallback m_callback;
+  FILE *m_fp; // owned by the request when opened by get_file_async().
+  CURLcode m_result;
+  bool m_done;
+  bool m_owned; // deleted by the executor once complete.
+  bool m_limited; // counted against HttpExecutor::max_transfers().
+  bool m_conn_auth; // uses a connection based authentication scheme.
+  int m_attempts; // retries so far.
+  int m_max_retries;
+  double m_started; // when the current attempt was attached.
+  long m_stall_timeout; // -1 uses the executor's.
+  bool m_idempotent; // GET or HEAD, safe to retry and hedge.
+  HttpRequest *m_primary; // set on hedges, the request they duplicate.
+  HttpRequest *m_hedge; // running duplicate of this request.
+  bool m_hedged; // this attempt was already hedged.
+  curl_off_t m_range_from; // offset requested by the current attempt.
+  long m_timeout; // overall limit in seconds, 0 for none.
 };
 
 /* Public functions */
@@ -14,22 +14,36 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <map>
+#include <memory>
 #include <stdexcept>
 
 #include "services/http.h"
 #include "services/tfsproxy.h"
 #include "utils/cJSON.h"
+#include "utils/jsondocument.h"
+#include "utils/jsonreader.h"
+#include "utils/jsonschema.h"
 #include "utils/logging.h"
 #include "utils/web.h"
 
 using namespace http;
+using utils::JsonField;
+using utils::JsonSchema;
+using utils::MakeSchema;
+using utils::SetBool;
+using utils::SetInt;
+using utils::SetString;
 
 TfsProxy::TfsProxy(const std::string &baseurl, const std::string &branch,
     const std::string &username, const std::string &password) :
   _baseurl(baseurl), _branch(branch), _username(username),
-  _password(password)
+  _password(password), _auth(AUTH_NTLM)
 {
 }
 
@@ -37,11 +51,30 @@ TfsProxy::~TfsProxy()
 {
 }
 
+void TfsProxy::authorize(HttpRequest &req) const
+{
+  req.set_auth(_auth, _username, _password);
+}
+
+void TfsProxy::Prewarm(int connections, HttpExecutor& executor) const
+{
+  std::string url = _baseurl + "/_apis/connectionData";
+
+  executor.prewarm(url, connections, [this](HttpRequest& req) {
+    authorize(req);
+  });
+}
+
+// Parsing takes the body over and writes into it, so a response that turns
+// out not to be JSON is logged from a copy of its start.
+static const size_t logged_body = 512;
+
+// The returned tree belongs to doc.
 cJSON *TfsProxy::sendReq(const char *method, std::string &url,
-  const char *body) const
+  const char *body, utils::JsonDocument &doc) const
 {
   HttpRequest req(url, false);
-  req.set_ntlm(_username, _password);
+  authorize(req);
   req.set_content("application/json");
 
   HttpResponse res = req.exec(method, body);
@@ -54,60 +87,298 @@ cJSON *TfsProxy::sendReq(const char *method, std::string &url,
     return NULL;
   }
 
-  return cJSON_Parse(res.body.c_str());
+  // Parsed right here: polling the executor until a decode thread is done
+  // would run the completions of other requests from within this call.
+  // These are single objects, the listings go through decode_body().
+  std::string head = res.body.substr(0, logged_body);
+  cJSON *root = doc.parse(res.body);
+  if (root == NULL)
+    log_tmsg(0, "Response of %s is not JSON\n%s\n", url.c_str(), head.c_str());
+  return root;
 }
 
-bool TfsProxy::GetChangesAfter(const std::string &changeset,
-  std::vector<ChangesetInfo> &changes)
+// Parse the body of res on a decode thread (see HttpExecutor::decode())
+// and hand the root, NULL if the body is not JSON, to decode there. done
+// then learns on the executor's thread what decode returned. The body is
+// taken from res, as the request is gone by the time it is parsed.
+static void decode_body(HttpExecutor& executor, HttpResponse& res,
+    const std::function<bool(cJSON *)>& decode,
+    const std::function<void(bool)>& done)
 {
-  std::string url = _baseurl;
-  std::string api_url = "/changesets?searchCriteria.fromId=" + changeset +
-    "&searchCriteria.itemPath=" + _branch + "&$orderby=id asc";
-
-  url.append(utils::UrlEncode(api_url));
-
-  cJSON *data = sendReq("GET", url, NULL);
-  if (data == NULL) {
-    return false;
-  }
-
-  // Iterate through all changesets.
-  cJSON *countItem = cJSON_GetObjectItem(data, "count");
-  if (countItem != NULL && countItem->type == cJSON_Number) {
-    changes.reserve(countItem->valueint);
-  }
+  std::shared_ptr<std::string> body(new std::string);
+  std::shared_ptr<bool> ok(new bool(false));
+  std::shared_ptr<bool> json(new bool(false));
+  std::string head = res.body.substr(0, logged_body);
+
+  body->swap(res.body);
+  executor.decode([body, ok, json, decode] {
+    utils::JsonDocument doc;
+    cJSON *root = doc.parse(*body);
+    *json = root != NULL;
+    *ok = decode(root);
+  }, [ok, json, done, head] {
+    if (!*json)
+      log_tmsg(0, "Response is not JSON\n%s", head.c_str());
+    done(*ok);
+  });
+}
 
-  cJSON *valueArray = cJSON_GetObjectItem(data, "value");
-  if (valueArray == NULL || valueArray->type != cJSON_Array)
-    return false;
+// Comments up to this long come with the changeset listing. Longer ones are
+// cut short there and fetched one changeset at a time.
+static const int inline_comment_length = 2000;
+
+// Where the members of a changeset in a listing go. The author's name is
+// in author.displayName.
+static const JsonField<ChangesetInfo> author_fields[] = {
+  { "displayName", SetString<ChangesetInfo, &ChangesetInfo::Author>, NULL },
+};
+static const JsonSchema<ChangesetInfo> author_schema =
+  MakeSchema(author_fields);
+
+static const JsonField<ChangesetInfo> changeset_fields[] = {
+  { "changesetId", SetInt<ChangesetInfo, &ChangesetInfo::ChangesetId>, NULL },
+  { "author", NULL, &author_schema },
+  { "comment", SetString<ChangesetInfo, &ChangesetInfo::Comment>, NULL },
+  { "commentTruncated",
+    SetBool<ChangesetInfo, &ChangesetInfo::CommentTruncated>, NULL },
+};
+static const JsonSchema<ChangesetInfo> changeset_schema =
+  MakeSchema(changeset_fields);
+
+// A page of a listing. Pending counts the requests that still have to
+// complete it, see fetch_pages().
+template <class T>
+struct listing_page {
+  std::vector<T> Items;
+  int Pending;
+};
+
+// Fetch a listing in pages of page_size using $top/$skip (url ends with
+// "%24skip="), up to concurrency pages at a time, and hand the items to
+// deliver in order. The pages live until they are delivered, so memory is
+// bounded by the number of pages in flight. decode fills the items of a
+// page from the "value" array of its response; it runs on a decode thread
+// and must not touch anything else. complete then gets the page on this
+// thread and may start further requests to complete it, counting them in
+// Pending. An empty page ends the listing. Servers cap $top, so a short
+// page only ends it if the next one is empty; if not, the pages came back
+// shorter than page_size and items were skipped, which fails the listing.
+template <class T>
+static bool fetch_pages(HttpExecutor& executor, const std::string& url,
+    int page_size, int concurrency,
+    const std::function<void(HttpRequest&)>& prepare,
+    const std::function<bool(cJSON *, std::vector<T>&)>& decode,
+    const std::function<void(listing_page<T>&)>& complete,
+    const std::function<bool(const T&)>& deliver)
+{
+  page_size = std::max(page_size, 1);
+  concurrency = std::max(concurrency, 1);
+
+  // Pages that arrived ahead of their predecessors wait here.
+  std::map<int, listing_page<T> > arrived;
+  int next_page = 0;       // next page to request.
+  int next_delivered = 0;  // next page to hand over.
+  int in_flight = 0;
+  int short_page = -1;     // first page with fewer than page_size items.
+  size_t short_count = 0;
+  bool done = false;
+  bool ok = true;
+
+  for (;;) {
+    // Keep at most concurrency pages requested or waiting.
+    while (!done && next_page - next_delivered < concurrency) {
+      HttpRequest *req = new HttpRequest(url +
+          std::to_string(next_page * page_size), false, executor);
+      prepare(*req);
+
+      int page = next_page++;
+      in_flight++;
+      req->exec_async("GET", NULL, [&executor, &arrived, &in_flight, &done,
+          &ok, &decode, &complete, page](HttpRequest& r) {
+        HttpResponse& res = r.response();
+        if (done || r.result() != CURLE_OK || res.status_code != 200) {
+          in_flight--;
+          if (!done) {
+            log_tmsg(0, "Page %d of %s failed with status %ld\n%s", page,
+                r.url().c_str(), res.status_code, res.body.c_str());
+            ok = false;
+            done = true;
+          }
+          return;
+        }
+
+        // The page counts as in flight until it is decoded.
+        std::shared_ptr<std::vector<T> > items(new std::vector<T>);
+        std::string url = r.url();
+        decode_body(executor, res, [items, &decode](cJSON *data) {
+          cJSON *values = data != NULL ? cJSON_GetObjectItem(data, "value") :
+            NULL;
+          return values != NULL && values->type == cJSON_Array &&
+            decode(values, *items);
+        }, [&arrived, &in_flight, &done, &ok, &complete, page, items,
+            url](bool decoded) {
+          in_flight--;
+          if (done)
+            return;
+          if (!decoded) {
+            log_tmsg(0, "Page %d of %s is not a listing", page, url.c_str());
+            ok = false;
+            done = true;
+            return;
+          }
+
+          listing_page<T>& p = arrived[page];
+          p.Pending = 0;
+          p.Items.swap(*items);
+          complete(p);
+        });
+      });
+    }
 
-  for (cJSON *value = valueArray->child; value != NULL;
-      value = value->next) {
-    ChangesetInfo ci;
+    // Hand over the pages that are next in line.
+    typename std::map<int, listing_page<T> >::iterator it;
+    while (!done && (it = arrived.find(next_delivered)) != arrived.end() &&
+        it->second.Pending == 0) {
+      size_t count = it->second.Items.size();
+      if (count > 0 && short_page >= 0) {
+        log_tmsg(0, "Page %d of %s has %zu items instead of %d, the server "
+            "returns fewer per page; use a smaller page size", short_page,
+            url.c_str(), short_count, page_size);
+        ok = false;
+        done = true;
+        break;
+      }
 
-    // Parse value objects
-    cJSON *changesetId = cJSON_GetObjectItem(value, "changesetId");
-    if (changesetId != NULL && changesetId->type == cJSON_Number) {
-      ci.ChangesetId = changesetId->valueint;
+      for (const auto& item : it->second.Items) {
+        if (!deliver(item)) {
+          done = true;
+          break;
+        }
+      }
+      if (count == 0) {
+        done = true;
+      } else if (count < static_cast<size_t>(page_size)) {
+        short_page = next_delivered;
+        short_count = count;
+      }
+      arrived.erase(it);
+      next_delivered++;
     }
 
-    cJSON *authorObj = cJSON_GetObjectItem(value, "author");
-    if (authorObj != NULL && authorObj->type == cJSON_Object) {
-      cJSON *authorName = cJSON_GetObjectItem(authorObj, "displayName");
-      if (authorName != NULL && authorName->type == cJSON_String) {
-        ci.Author = authorName->valuestring;
-      }
+    if (done && in_flight == 0) {
+      bool pending = false;
+      for (const auto& p : arrived)
+        pending = pending || p.second.Pending > 0;
+      if (!pending)
+        break;
     }
 
-    changes.push_back(ci);
+    // Pages were handed over, request the next ones before waiting: there
+    // may be nothing else in flight to wake the wait up.
+    if (!done && next_page - next_delivered < concurrency)
+      continue;
+
+    executor.poll();
   }
 
-  // Debugging.
-  //  printf("%s\n", cJSON_Print(data));
+  return ok;
+}
+
+bool TfsProxy::GetChangesAfter(int from_id, const ChangesetCallback& cb,
+    int page_size, int concurrency) const
+{
+  HttpExecutor& executor = HttpExecutor::default_instance();
+  std::string url = _baseurl + "/_apis/tfvc/changesets?searchCriteria.fromId=" +
+    std::to_string(from_id) + "&searchCriteria.itemPath=" +
+    utils::UrlEncode(_branch) + "&maxCommentLength=" +
+    std::to_string(inline_comment_length) + "&%24orderby=id%20asc&%24top=" +
+    std::to_string(std::max(page_size, 1)) + "&%24skip=";
+  int last_id = from_id - 1;
+  bool comments_ok = true;
+
+  // Fetch the full comment of a changeset of page p. The changeset keeps
+  // its shortened comment if that fails.
+  auto fetch_comment = [this, &executor, &comments_ok](
+      listing_page<ChangesetInfo>& p, size_t index) {
+    HttpRequest *req = new HttpRequest(_baseurl + "/_apis/tfvc/changesets/" +
+        std::to_string(p.Items[index].ChangesetId), false, executor);
+    authorize(*req);
+    req->set_content("application/json");
+
+    p.Pending++;
+    req->exec_async("GET", NULL, [&executor, &comments_ok, &p,
+        index](HttpRequest& r) {
+      HttpResponse& res = r.response();
+      long status_code = res.status_code;
+
+      if (r.result() != CURLE_OK || status_code != 200) {
+        p.Pending--;
+        comments_ok = false;
+        log_tmsg(0, "Comment of changeset %d failed with status %ld\n%s",
+            p.Items[index].ChangesetId, status_code, res.body.c_str());
+        return;
+      }
 
-  cJSON_Delete(data);
+      std::shared_ptr<std::string> text(new std::string);
+      decode_body(executor, res, [text](cJSON *data) {
+        cJSON *comment = data != NULL ? cJSON_GetObjectItem(data, "comment") :
+          NULL;
+        if (comment == NULL || comment->type != cJSON_String)
+          return false;
+        *text = comment->valuestring;
+        return true;
+      }, [&comments_ok, &p, index, status_code, text](bool found) {
+        ChangesetInfo& ci = p.Items[index];
+        p.Pending--;
+        if (found) {
+          ci.Comment.swap(*text);
+          ci.CommentTruncated = false;
+        } else {
+          comments_ok = false;
+          log_tmsg(0, "Comment of changeset %d failed with status %ld",
+              ci.ChangesetId, status_code);
+        }
+      });
+    });
+  };
+
+  bool ok = fetch_pages<ChangesetInfo>(executor, url, page_size, concurrency,
+      [this](HttpRequest& req) {
+    authorize(req);
+    req.set_content("application/json");
+  }, [](cJSON *values, std::vector<ChangesetInfo>& items) {
+    items.reserve(cJSON_GetArraySize(values));
+    for (cJSON *value = values->child; value != NULL; value = value->next) {
+      items.push_back(ChangesetInfo());
+      utils::DecodeObject(changeset_schema, value, items.back());
+    }
+    return true;
+  }, [&fetch_comment](listing_page<ChangesetInfo>& p) {
+    // The long comments of a page are fetched concurrently.
+    for (size_t index = 0; index < p.Items.size(); index++) {
+      if (p.Items[index].CommentTruncated)
+        fetch_comment(p, index);
+    }
+  }, [&cb, &last_id](const ChangesetInfo& ci) {
+    // The listing is ordered by id and new changesets are only ever
+    // appended, so $skip keeps addressing the same changesets while the
+    // pages are fetched. Skip any repeats all the same.
+    if (ci.ChangesetId <= last_id)
+      return true;
+    last_id = ci.ChangesetId;
+    return cb(ci);
+  });
+  return ok && comments_ok;
+}
 
-  return true;
+bool TfsProxy::GetChangesAfter(const std::string &changeset,
+  std::vector<ChangesetInfo> &changes)
+{
+  return GetChangesAfter(atoi(changeset.c_str()),
+      [&changes](const ChangesetInfo& ci) {
+    changes.push_back(ci);
+    return true;
+  });
 }
 
 bool TfsProxy::GetChangesetComment(ChangesetInfo &changeset)
@@ -117,10 +388,11 @@ bool TfsProxy::GetChangesetComment(ChangesetInfo &changeset)
 
   snprintf(changesetId, sizeof(changesetId), "%d", changeset.ChangesetId);
 
-  url.append("/changesets/");
+  url.append("/_apis/tfvc/changesets/");
   url.append(changesetId);
 
-  cJSON *data = sendReq("GET", url, NULL);
+  utils::JsonDocument doc;
+  cJSON *data = sendReq("GET", url, NULL, doc);
   if (data == NULL) {
     return false;
   }
@@ -134,76 +406,57 @@ bool TfsProxy::GetChangesetComment(ChangesetInfo &changeset)
   // Debugging.
   //  printf("%s\n", cJSON_Print(data));
 
-  cJSON_Delete(data);
-
   return true;
 }
 
-bool TfsProxy::GetChangesetChanges(ChangesetInfo &changeset)
+// Where the members of a change go: the change type, and the version,
+// path and url of the changed item.
+static const JsonField<ChangesetChange> changed_item_fields[] = {
+  { "version", SetInt<ChangesetChange, &ChangesetChange::Version>, NULL },
+  { "path", SetString<ChangesetChange, &ChangesetChange::Path>, NULL },
+  { "url", SetString<ChangesetChange, &ChangesetChange::Url>, NULL },
+};
+static const JsonSchema<ChangesetChange> changed_item_schema =
+  MakeSchema(changed_item_fields);
+
+static const JsonField<ChangesetChange> change_fields[] = {
+  { "changeType", SetString<ChangesetChange, &ChangesetChange::ChangeType>,
+    NULL },
+  { "item", NULL, &changed_item_schema },
+};
+static const JsonSchema<ChangesetChange> change_schema =
+  MakeSchema(change_fields);
+
+bool TfsProxy::GetChangesetChanges(int changeset_id, const ChangeCallback& cb,
+    int page_size, int concurrency) const
 {
-  char changesetId[32];
-  std::string url = _baseurl;
-
-  snprintf(changesetId, sizeof(changesetId), "%d", changeset.ChangesetId);
-
-  url.append("/changesets/");
-  url.append(changesetId);
-  url.append("/changes?%24top=2000");
-
-  cJSON *data = sendReq("GET", url, NULL);
-  if (data == NULL) {
-    return false;
-  }
-
-  // Iterate through all changes.
-  cJSON *countItem = cJSON_GetObjectItem(data, "count");
-  if (countItem != NULL && countItem->type == cJSON_Number) {
-    changeset.changes.reserve(countItem->valueint);
-  }
-
-  cJSON *valueArray = cJSON_GetObjectItem(data, "value");
-  if (valueArray == NULL || valueArray->type != cJSON_Array)
-    return false;
-
-  for (cJSON *value = valueArray->child; value != NULL;
-      value = value->next) {
-    ChangesetChange change;
-
-    // Parse value objects (each contains an item and change type)
-    cJSON *changeType = cJSON_GetObjectItem(value, "changeType");
-    if (changeType != NULL && changeType->type == cJSON_String) {
-      change.ChangeType = changeType->valuestring;
-    }
-
-    cJSON *itemObj = cJSON_GetObjectItem(value, "item");
-    if (itemObj != NULL && itemObj->type == cJSON_Object) {
-
-      // Grab version (int), path (string), and url (url).
-      cJSON *itemAtt = cJSON_GetObjectItem(itemObj, "version");
-      if (itemAtt != NULL && itemAtt->type == cJSON_Number) {
-        change.Version = itemAtt->valueint;
-      }
-
-      itemAtt = cJSON_GetObjectItem(itemObj, "path");
-      if (itemAtt != NULL && itemAtt->type == cJSON_String) {
-        change.Path = itemAtt->valuestring;
-      }
-
-      itemAtt = cJSON_GetObjectItem(itemObj, "url");
-      if (itemAtt != NULL && itemAtt->type == cJSON_String) {
-        change.Url = itemAtt->valuestring;
-      }
+  std::string url = _baseurl + "/_apis/tfvc/changesets/" +
+    std::to_string(changeset_id) + "/changes?%24top=" +
+    std::to_string(std::max(page_size, 1)) + "&%24skip=";
+
+  return fetch_pages<ChangesetChange>(HttpExecutor::default_instance(), url,
+      page_size, concurrency, [this](HttpRequest& req) {
+    authorize(req);
+    req.set_content("application/json");
+  }, [](cJSON *values, std::vector<ChangesetChange>& items) {
+    items.reserve(cJSON_GetArraySize(values));
+    for (cJSON *value = values->child; value != NULL; value = value->next) {
+      items.push_back(ChangesetChange());
+      utils::DecodeObject(change_schema, value, items.back());
     }
+    return true;
+  }, [](listing_page<ChangesetChange>&) {
+  }, cb);
+}
 
+bool TfsProxy::GetChangesetChanges(ChangesetInfo &changeset)
+{
+  changeset.changes.clear();
+  return GetChangesetChanges(changeset.ChangesetId,
+      [&changeset](const ChangesetChange& change) {
     changeset.changes.push_back(change);
-  }
-
-  // Debugging.
-  //  printf("%s\n", cJSON_Print(data));
-
-  cJSON_Delete(data);
-
-  return true;
+    return true;
+  });
 }
 
 bool TfsProxy::GetChangesetFile(ChangesetChange &change, const std::string &id)
@@ -238,7 +491,7 @@ bool TfsProxy::GetChangesetFile(ChangesetChange &change, const std::string &id)
 
   // Get specific changeset version.
   HttpRequest req(new_url);
-  req.set_ntlm(_username, _password);
+  authorize(req);
 
   // Filename will be the last part of the path after the final '/'
   std::string::size_type last_slash = change.Path.rfind('/');
@@ -250,18 +503,40 @@ bool TfsProxy::GetChangesetFile(ChangesetChange &change, const std::string &id)
   return req.get_file(filename.c_str());
 }
 
-std::vector<TfFileInfo> TfsProxy::GetPathInfo(const std::string& project, const std::string &path) const
+static void parse_item(cJSON *itemObj, TfFileInfo &file)
+{
+  file = TfFileInfo();
+  utils::DecodeObject(TfFileInfoSchema, itemObj, file);
+}
+
+std::string TfsProxy::ItemUrl(const std::string& path, int version) const
+{
+  // The path goes in the query rather than the URL path, which ASP .NET
+  // refuses for some files (like web.config).
+  return _baseurl + "/_apis/tfvc/items?path=" + utils::UrlEncode(path) +
+    "&versionType=Changeset&version=" + std::to_string(version);
+}
+
+std::string TfsProxy::itemsUrl(const std::string& project,
+    const std::string& path, bool full) const
 {
   std::string url = _baseurl;
   url += "/";
   url += project;
   url += "/_apis/tfvc/items?scopePath=";
   url += utils::UrlEncode(path);
-  url += "&recursionLevel=OneLevel";
+  url += full ? "&recursionLevel=Full" : "&recursionLevel=OneLevel";
+  return url;
+}
+
+std::vector<TfFileInfo> TfsProxy::GetPathInfo(const std::string& project, const std::string &path) const
+{
+  std::string url = itemsUrl(project, path, false);
 
   std::vector<TfFileInfo> files;
 
-  cJSON *data = sendReq("GET", url, NULL);
+  utils::JsonDocument doc;
+  cJSON *data = sendReq("GET", url, NULL, doc);
   if (data == nullptr) {
     return files;
   }
@@ -275,28 +550,10 @@ std::vector<TfFileInfo> TfsProxy::GetPathInfo(const std::string& project, const
       cJSON *itemObj = cJSON_GetArrayItem(values, i);
       TfFileInfo file;
 
-      // Grab version (int), path (string), url (string), isFolder (bool).
-      cJSON *itemAtt = cJSON_GetObjectItem(itemObj, "version");
-      if (itemAtt != NULL && itemAtt->type == cJSON_Number) {
-        file.Version = itemAtt->valueint;
-      }
-
-      itemAtt = cJSON_GetObjectItem(itemObj, "path");
-      if (itemAtt != NULL && itemAtt->type == cJSON_String) {
-        file.Path = itemAtt->valuestring;
-      }
-      if (file.Path.compare(path) == 0)
+      parse_item(itemObj, file);
+      if (TfTree::SamePath(file.Path, path))
         continue;
 
-      itemAtt = cJSON_GetObjectItem(itemObj, "url");
-      if (itemAtt != NULL && itemAtt->type == cJSON_String) {
-        file.Url = itemAtt->valuestring;
-      }
-      file.IsFolder = false;
-      itemAtt = cJSON_GetObjectItem(itemObj, "isFolder");
-      if (itemAtt != NULL && itemAtt->type == cJSON_True) {
-        file.IsFolder = true;
-      }
       files.push_back(file);
     }
   }
@@ -304,10 +561,331 @@ std::vector<TfFileInfo> TfsProxy::GetPathInfo(const std::string& project, const
   return files;
 }
 
+// Decodes the items of a listing as the response arrives, handing each one
+// over as soon as its closing brace is in. Only the item being read is kept
+// in memory, never the response.
+class item_stream : public utils::JsonHandler, public BodySink {
+public:
+  explicit item_stream(const ItemCallback& cb) : _reader(*this),
+    _items(TfFileInfoSchema), _cb(cb), _delivered(0)
+  {
+    restart();
+  }
+
+  bool write(const char *data, size_t len) override
+  {
+    return _reader.feed(data, len);
+  }
+
+  // A retry starts from the top, skip what was handed over already.
+  void restart() override
+  {
+    _reader.reset();
+    _items.reset();
+    _depth = 0;
+    _in_values = false;
+    _found_values = false;
+    _seen = 0;
+  }
+
+  // The whole response is in. Returns whether it was a listing.
+  bool finish()
+  {
+    return _reader.finish() && _found_values;
+  }
+
+  // Everything within an item goes to _items, the rest only matters for
+  // finding the top level "value" array.
+  void begin_object() override
+  {
+    if (_items.active()) {
+      _items.nest(true);
+    } else if (_in_values && _depth == 2) {
+      _item = TfFileInfo();
+      _items.begin(_item);
+    } else {
+      _depth++;
+    }
+  }
+
+  void end_object() override
+  {
+    if (!_items.active()) {
+      _depth--;
+    } else if (_items.end() && ++_seen > _delivered) {
+      _delivered++;
+      _cb(_item);
+    }
+  }
+
+  void begin_array() override
+  {
+    if (_items.active()) {
+      _items.nest(false);
+      return;
+    }
+    if (_depth == 1 && _key == "value")
+      _in_values = true;
+    _depth++;
+  }
+
+  void end_array() override
+  {
+    if (_items.active()) {
+      _items.end();
+      return;
+    }
+    _depth--;
+    if (_in_values && _depth == 1) {
+      _in_values = false;
+      _found_values = true;
+    }
+  }
+
+  void key(const std::string &name) override
+  {
+    if (_items.active())
+      _items.key(name);
+    else
+      _key = name;
+  }
+
+  void string(const std::string &value) override
+  {
+    scalar(cJSON_String, value.c_str(), 0);
+  }
+
+  void number(double value) override { scalar(cJSON_Number, NULL, value); }
+
+  void boolean(bool value) override
+  {
+    scalar(value ? cJSON_True : cJSON_False, NULL, 0);
+  }
+
+  void null() override { scalar(cJSON_NULL, NULL, 0); }
+
+private:
+  void scalar(int type, const char *string, double number)
+  {
+    if (_items.active()) {
+      utils::JsonScalar value = { type, string, number };
+      _items.scalar(value);
+    }
+  }
+
+  utils::JsonReader _reader;
+  utils::SchemaReader<TfFileInfo> _items;
+  ItemCallback _cb;
+  size_t _delivered;    // items handed to _cb, over all attempts.
+  size_t _seen;         // items read by this attempt.
+  int _depth;           // open objects and arrays, outside of items.
+  bool _in_values;      // inside the top level "value" array.
+  bool _found_values;
+  std::string _key;     // last key read outside of items.
+  TfFileInfo _item;
+};
+
+bool TfsProxy::ListItems(const std::string& project, const std::string& path,
+    bool full, const ItemCallback& cb) const
+{
+  std::string url = itemsUrl(project, path, full);
+  item_stream items(cb);
+
+  HttpRequest req(url, false);
+  authorize(req);
+  req.set_content("application/json");
+  req.set_body_sink(&items);
+
+  HttpResponse res = req.exec("GET", NULL);
+  if (res.status_code != 200) {
+    log_tmsg(0, "Made request to %s, and status code is %d\n%s\n", url.c_str(),
+        res.status_code, res.body.c_str());
+    return false;
+  }
+  if (req.result() != CURLE_OK || !items.finish()) {
+    log_tmsg(0, "Listing %s failed: %s\n", path.c_str(),
+        req.result() != CURLE_OK ? http_get_error_str(req.result()) :
+        "unexpected response");
+    return false;
+  }
+
+  return true;
+}
+
+bool TfsProxy::GetTree(const std::string& project, const std::string& path,
+    TfTree& tree) const
+{
+  // Urls are left out, they can be rebuilt from the path.
+  tree.Begin(path);
+  bool ok = ListItems(project, path, true, [&tree](const TfFileInfo& item) {
+    tree.Add(item.Path, item.Version, item.IsFolder, item.Size,
+        item.HashValue);
+  });
+
+  if (!ok) {
+    tree.Begin(path);
+    return false;
+  }
+  return tree.Finish();
+}
+
+void TfsProxy::QueuePathInfo(const std::string& project,
+    const std::string& path, const ListingOptions& options,
+    const ListingCallback& cb, HttpExecutor& executor) const
+{
+  HttpRequest *req = new HttpRequest(itemsUrl(project, path, options.Full),
+      false, executor);
+  authorize(*req);
+  if (options.Timeout > 0)
+    req->set_timeout(options.Timeout);
+  if (options.MaxBytes > 0)
+    req->set_max_body(options.MaxBytes);
+
+  // The items are decoded while the listing downloads.
+  struct listing {
+    TfTree tree;
+    std::vector<TfFileInfo> items;
+  };
+  auto partial = std::make_shared<listing>();
+  if (options.Full)
+    partial->tree.Begin(path);
+
+  bool full = options.Full;
+  listing *into = partial.get();
+  auto stream = std::make_shared<item_stream>(
+      [into, full, path](const TfFileInfo& item) {
+    if (full) {
+      into->tree.Add(item.Path, item.Version, item.IsFolder, item.Size,
+          item.HashValue);
+    } else if (!TfTree::SamePath(item.Path, path)) {
+      // A one level listing of a folder starts with the folder itself.
+      into->items.push_back(item);
+    }
+  });
+  req->set_body_sink(stream.get());
+
+  auto done = [path, options, cb, partial, stream](HttpRequest& r) {
+    ListingResult result;
+    result.Path = path;
+    result.Full = options.Full;
+    result.Success = false;
+
+    long status_code = r.response().status_code;
+    if (r.result() != CURLE_OK) {
+      result.Error = http_get_error_str(r.result());
+      cb(result);
+      return;
+    }
+    if (status_code != 200) {
+      result.Error = "HTTP status " + std::to_string(status_code);
+      cb(result);
+      return;
+    }
+
+    if (!stream->finish()) {
+      result.Error = "Unexpected response";
+    } else if (options.Full) {
+      result.Tree = std::move(partial->tree);
+      result.Success = result.Tree.Finish();
+      if (!result.Success)
+        result.Error = "The listing does not include " + path;
+    } else {
+      result.Items.swap(partial->items);
+      result.Success = true;
+    }
+    cb(result);
+  };
+
+  req->exec_async("GET", NULL, done);
+}
+
+// Item descriptors sent per itembatch request.
+static const size_t items_per_batch = 500;
+
+bool TfsProxy::GetItemsBatch(const std::string& project,
+    const std::vector<std::string>& paths, int version,
+    std::vector<TfFileInfo>& items) const
+{
+  HttpExecutor& executor = HttpExecutor::default_instance();
+  std::string url = _baseurl + "/" + project + "/_apis/tfvc/itembatch";
+  std::string version_str = std::to_string(version);
+  size_t remaining = 0;
+  bool ok = true;
+
+  items.assign(paths.size(), TfFileInfo());
+
+  // Long lists are split up into several requests, which run concurrently.
+  for (size_t first = 0; first < paths.size(); first += items_per_batch) {
+    size_t count = std::min(items_per_batch, paths.size() - first);
+
+    cJSON *body = cJSON_CreateObject();
+    cJSON *descriptors = cJSON_CreateArray();
+    for (size_t i = first; i < first + count; i++) {
+      cJSON *desc = cJSON_CreateObject();
+      cJSON_AddItemToObject(desc, "path", cJSON_CreateString(paths[i].c_str()));
+      cJSON_AddItemToObject(desc, "recursionLevel",
+          cJSON_CreateString("none"));
+      if (version > 0) {
+        cJSON_AddItemToObject(desc, "versionType",
+            cJSON_CreateString("changeset"));
+        cJSON_AddItemToObject(desc, "version",
+            cJSON_CreateString(version_str.c_str()));
+      }
+      cJSON_AddItemToArray(descriptors, desc);
+    }
+    cJSON_AddItemToObject(body, "itemDescriptors", descriptors);
+    char *json = cJSON_PrintUnformatted(body);
+    cJSON_Delete(body);
+
+    HttpRequest *req = new HttpRequest(url, false, executor);
+    authorize(*req);
+    req->set_content("application/json");
+
+    remaining++;
+    req->exec_async("POST", json, [&executor, &items, &remaining, &ok, first,
+        count](HttpRequest& r) {
+      HttpResponse& res = r.response();
+      if (r.result() != CURLE_OK || res.status_code != 200) {
+        remaining--;
+        log_tmsg(0, "Item batch request failed with status %ld\n%s",
+            res.status_code, res.body.c_str());
+        ok = false;
+        return;
+      }
+
+      // The response holds one array of items per descriptor, in order.
+      // Each batch decodes into its own range of items, which stays put.
+      decode_body(executor, res, [&items, first, count](cJSON *data) {
+        cJSON *values = data != NULL ? cJSON_GetObjectItem(data, "value") :
+          NULL;
+        if (values == NULL || values->type != cJSON_Array)
+          return false;
+
+        size_t i = first;
+        for (cJSON *found = values->child; found != NULL && i < first + count;
+            found = found->next, i++) {
+          if (found->type == cJSON_Array && found->child != NULL)
+            parse_item(found->child, items[i]);
+        }
+        return true;
+      }, [&remaining, &ok](bool decoded) {
+        remaining--;
+        ok = ok && decoded;
+      });
+    });
+    free(json);
+  }
+
+  while (remaining > 0) {
+    executor.poll();
+  }
+  return ok;
+}
+
 void TfsProxy::GetDirectFile(const std::string& filename_url) const
 {
   HttpRequest req(filename_url);
-  req.set_ntlm(_username, _password);
+  authorize(req);
 
   // Filename will be the last part of the path after the final '/'
   std::string::size_type last_slash = filename_url.rfind('/');
@@ -323,3 +901,65 @@ void TfsProxy::GetDirectFile(const std::string& filename_url) const
 
   req.get_file(filename.c_str());
 }
+
+// Downloads are written to <file>.partial and renamed once complete. The
+// journal tells which version a partial file left by an earlier run holds.
+void TfsProxy::QueueDirectFile(const std::string& url,
+    const std::string& local_path, int version, DownloadJournal& journal,
+    const DownloadCallback& cb, HttpExecutor& executor) const
+{
+  std::string partial_path = local_path + ".partial";
+  int partial_version = 0;
+  std::string etag;
+
+  // A partial download of another version is useless, the file is
+  // truncated when opened instead.
+  bool resume = journal.Find(local_path, partial_version, etag) &&
+    partial_version == version;
+  if (!resume) {
+    etag.clear();
+    journal.Record(local_path, version, etag);
+  }
+
+  HttpRequest *req = new HttpRequest(url, false, executor);
+  authorize(*req);
+
+  auto done = [url, local_path, partial_path, version, &journal,
+      cb](HttpRequest& r) {
+    DownloadResult result;
+    result.Url = url;
+    result.LocalPath = local_path;
+    result.StatusCode = r.response().status_code;
+    result.Success = false;
+    result.Seconds = r.response().elapsed;
+
+    if (r.result() != CURLE_OK) {
+      result.Error = http_get_error_str(r.result());
+    } else if (result.StatusCode < 200 || result.StatusCode > 299) {
+      result.Error = "HTTP status " + std::to_string(result.StatusCode);
+    } else if (rename(partial_path.c_str(), local_path.c_str()) != 0) {
+      result.Error = strerror(errno);
+    } else {
+      result.Success = true;
+    }
+
+    if (!result.Success)
+      journal.Record(local_path, version, r.response().header("ETag"), true);
+    cb(result);
+  };
+
+  bool queued = resume ?
+    req->resume_file_async(partial_path.c_str(), etag, done) :
+    req->get_file_async(partial_path.c_str(), done);
+  if (!queued) {
+    DownloadResult result;
+    result.Url = url;
+    result.LocalPath = local_path;
+    result.Success = false;
+    result.StatusCode = 0;
+    result.Error = strerror(errno);
+    result.Seconds = 0;
+    delete req;
+    cb(result);
+  }
+}
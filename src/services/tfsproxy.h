@@ -17,12 +17,55 @@
 #ifndef __TFSPROXY_H__
 #define __TFSPROXY_H__
 
+#include <functional>
 #include <string>
 #include <vector>
 
 #include "models/ChangesetInfo.h"
 #include "models/TfFileInfo.h"
+#include "models/TfTree.h"
+#include "services/downloadjournal.h"
+#include "services/http.h"
 #include "utils/cJSON.h"
+#include "utils/jsondocument.h"
+
+// Outcome of a single queued file download.
+struct DownloadResult {
+  std::string Url;
+  std::string LocalPath;
+  bool Success;
+  long StatusCode;
+  std::string Error;
+  double Seconds;  // duration of the last attempt.
+};
+
+typedef std::function<void(const DownloadResult &)> DownloadCallback;
+
+// How a queued folder listing is requested.
+struct ListingOptions {
+  bool Full;        // everything below the folder, not only its children.
+  long Timeout;     // seconds, 0 for no limit.
+  long MaxBytes;    // response size limit, 0 for none.
+};
+
+// Outcome of a queued folder listing.
+struct ListingResult {
+  std::string Path;
+  bool Full;
+  bool Success;
+  std::string Error;
+  std::vector<TfFileInfo> Items;  // one level listings.
+  TfTree Tree;                    // full listings.
+};
+
+typedef std::function<void(ListingResult &)> ListingCallback;
+
+typedef std::function<void(const TfFileInfo &)> ItemCallback;
+
+// Receive changesets, or the changes of one, one at a time. Returning false
+// stops the retrieval.
+typedef std::function<bool(const ChangesetInfo &)> ChangesetCallback;
+typedef std::function<bool(const ChangesetChange &)> ChangeCallback;
 
 class TfsProxy {
 public:
@@ -32,24 +75,81 @@ public:
       const std::string &password);
   ~TfsProxy();
 
+  // Defaults to NTLM. For personal access tokens the password is the token.
+  void SetAuthScheme(http::AuthScheme scheme) { _auth = scheme; }
+
+  // Authenticate the given number of connections in the background while
+  // other requests (typically the first listing) are in flight.
+  void Prewarm(int connections, http::HttpExecutor& executor) const;
+
+  // Download URL of an item at a version.
+  std::string ItemUrl(const std::string& path, int version) const;
+
   std::vector<TfFileInfo> GetPathInfo(const std::string& project, const std::string& path) const;
+
+  // List path and its children, or everything below it when full, handing
+  // each item to cb in listing order as the response arrives. Returns false
+  // if the listing failed, possibly after some items were handed over.
+  bool ListItems(const std::string& project, const std::string& path,
+      bool full, const ItemCallback& cb) const;
+
+  // List everything below path with a single recursive request. Returns
+  // false if the listing failed.
+  bool GetTree(const std::string& project, const std::string& path,
+      TfTree& tree) const;
+
+  // Metadata of many items (at changeset version, 0 for the latest) with
+  // few requests. items[i] describes paths[i]; items that do not exist
+  // are left with an empty Path. Returns false if a request failed.
+  bool GetItemsBatch(const std::string& project,
+      const std::vector<std::string>& paths, int version,
+      std::vector<TfFileInfo>& items) const;
+
+  // Queue a listing of path on the executor. A full listing comes as a
+  // tree rooted at path, a one level listing as the items of its children.
+  void QueuePathInfo(const std::string& project, const std::string& path,
+      const ListingOptions& options, const ListingCallback& cb,
+      http::HttpExecutor& executor) const;
   void GetDirectFile(const std::string& filename) const;
 
+  // Queue a download of url (version of the item) into local_path on the
+  // executor. The callback runs once the transfer finishes (or fails to
+  // start). Interrupted downloads of the same version, as the journal
+  // tells, are resumed.
+  void QueueDirectFile(const std::string& url, const std::string& local_path,
+      int version, DownloadJournal& journal, const DownloadCallback& cb,
+      http::HttpExecutor& executor) const;
+
+  // Stream the changesets of the branch from id from_id on to cb, in id
+  // order. They are fetched in pages of page_size, up to concurrency pages
+  // at a time. Comments are filled in. Returns false if a page or a comment
+  // could not be fetched.
+  bool GetChangesAfter(int from_id, const ChangesetCallback& cb,
+      int page_size = 100, int concurrency = 4) const;
   bool GetChangesAfter(const std::string &changeset,
     std::vector<ChangesetInfo> &changes);
 
   bool GetChangesetComment(ChangesetInfo &changeset);
+
+  // Stream the changes of a changeset to cb, fetched like GetChangesAfter().
+  bool GetChangesetChanges(int changeset_id, const ChangeCallback& cb,
+      int page_size = 1000, int concurrency = 4) const;
   bool GetChangesetChanges(ChangesetInfo &changeset);
 
   bool GetChangesetFile(ChangesetChange &change, const std::string &id);
 
 private:
-  cJSON *sendReq(const char *method, std::string &url, const char *body) const;
+  cJSON *sendReq(const char *method, std::string &url, const char *body,
+      utils::JsonDocument &doc) const;
+  std::string itemsUrl(const std::string& project, const std::string& path,
+      bool full) const;
+  void authorize(http::HttpRequest &req) const;
 
   std::string _baseurl;
   std::string _branch;
   std::string _username;
   std::string _password;
+  http::AuthScheme _auth;
 };
 
 #endif /* __TFSPROXY_H__ */
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2017 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Decodes the same items through DecodeObject (a parsed tree) and through
+// SchemaReader (JsonReader events, fed a byte at a time), and checks that
+// both agree with each other and with what the item should hold.
+
+#include <cstdio>
+#include <cstring>
+
+#include "models/TfFileInfo.h"
+#include "utils/cJSON.h"
+#include "utils/jsonreader.h"
+#include "utils/jsonschema.h"
+
+// Passes the events of a single top level object on to a SchemaReader.
+class object_stream : public utils::JsonHandler {
+public:
+  explicit object_stream(TfFileInfo &obj) : _reader(TfFileInfoSchema),
+    _obj(obj)
+  {
+  }
+
+  void begin_object() override
+  {
+    if (_reader.active())
+      _reader.nest(true);
+    else
+      _reader.begin(_obj);
+  }
+
+  void end_object() override { _reader.end(); }
+
+  void begin_array() override
+  {
+    if (_reader.active())
+      _reader.nest(false);
+  }
+
+  void end_array() override
+  {
+    if (_reader.active())
+      _reader.end();
+  }
+
+  void key(const std::string &name) override { _reader.key(name); }
+
+  void string(const std::string &value) override
+  {
+    scalar(cJSON_String, value.c_str(), 0);
+  }
+
+  void number(double value) override { scalar(cJSON_Number, NULL, value); }
+
+  void boolean(bool value) override
+  {
+    scalar(value ? cJSON_True : cJSON_False, NULL, 0);
+  }
+
+  void null() override { scalar(cJSON_NULL, NULL, 0); }
+
+private:
+  void scalar(int type, const char *string, double number)
+  {
+    if (_reader.active()) {
+      utils::JsonScalar value = { type, string, number };
+      _reader.scalar(value);
+    }
+  }
+
+  utils::SchemaReader<TfFileInfo> _reader;
+  TfFileInfo &_obj;
+};
+
+static int failures;
+
+static bool same(const TfFileInfo &a, const TfFileInfo &b)
+{
+  return a.Version == b.Version && a.IsFolder == b.IsFolder &&
+    a.Path == b.Path && a.Url == b.Url && a.Size == b.Size &&
+    a.HashValue == b.HashValue && a.Encoding == b.Encoding;
+}
+
+static void print_item(const char *name, const TfFileInfo &item)
+{
+  fprintf(stderr, "  %-8s version %d folder %d path '%s' url '%s' size %lld "
+      "hash '%s' encoding %d\n", name, item.Version, item.IsFolder,
+      item.Path.c_str(), item.Url.c_str(), (long long)item.Size,
+      item.HashValue.c_str(), item.Encoding);
+}
+
+static void check(const char *json, const TfFileInfo &expected)
+{
+  TfFileInfo tree = TfFileInfo();
+  cJSON *root = cJSON_Parse(json);
+  utils::DecodeObject(TfFileInfoSchema, root, tree);
+  cJSON_Delete(root);
+
+  TfFileInfo events = TfFileInfo();
+  object_stream stream(events);
+  utils::JsonReader reader(stream);
+  bool parsed = true;
+  for (const char *p = json; *p != '\0'; p++)
+    parsed = parsed && reader.feed(p, 1);
+  parsed = parsed && reader.finish();
+
+  if (root == NULL || !parsed || !same(tree, expected) ||
+      !same(events, expected)) {
+    failures++;
+    fprintf(stderr, "FAIL %s\n", json);
+    print_item("tree", tree);
+    print_item("events", events);
+    print_item("expected", expected);
+  }
+}
+
+int main()
+{
+  TfFileInfo file = TfFileInfo();
+  file.Version = 12;
+  file.Path = "$/Proj/a.txt";
+  file.Url = "http://tfs/items/a.txt";
+  file.Size = 5000000000LL;
+  file.HashValue = "abc=";
+  file.Encoding = 65001;
+  check("{\"version\":12,\"path\":\"$/Proj/a.txt\","
+      "\"url\":\"http://tfs/items/a.txt\",\"size\":5000000000,"
+      "\"hashValue\":\"abc=\",\"contentMetadata\":{\"encoding\":65001,"
+      "\"contentType\":\"text/plain\"}}", file);
+
+  TfFileInfo folder = TfFileInfo();
+  folder.Version = 3;
+  folder.IsFolder = true;
+  folder.Path = "$/Proj";
+  check("{\"version\":3,\"isFolder\":true,\"path\":\"$/Proj\"}", folder);
+
+  // The top level encoding wins over contentMetadata, whichever comes
+  // first.
+  TfFileInfo encoded = TfFileInfo();
+  encoded.Encoding = 1252;
+  check("{\"encoding\":1252,\"contentMetadata\":{\"encoding\":65001}}",
+      encoded);
+  check("{\"contentMetadata\":{\"encoding\":65001},\"encoding\":1252}",
+      encoded);
+  encoded.Encoding = -1;
+  check("{\"contentMetadata\":{\"encoding\":-1}}", encoded);
+
+  // Arrays, and objects that are not in the schema, are skipped with
+  // everything in them, even members that look like the item's.
+  TfFileInfo skipped = TfFileInfo();
+  skipped.Version = 1;
+  skipped.Path = "$/b";
+  check("{\"version\":1,\"tags\":[{\"version\":9},[\"path\"],{}],"
+      "\"owner\":{\"path\":\"$/c\",\"version\":9,\"more\":{\"size\":1}},"
+      "\"contentMetadata\":[{\"encoding\":5}],\"path\":\"$/b\"}", skipped);
+
+  // Values of the wrong type leave the member alone.
+  check("{\"version\":\"7\",\"isFolder\":1,\"path\":5,\"url\":null,"
+      "\"size\":\"9\",\"encoding\":true,\"contentMetadata\":{\"encoding\":"
+      "\"utf-8\"}}", TfFileInfo());
+  check("{\"path\":{\"version\":4},\"version\":[4]}", TfFileInfo());
+
+  // Names match without regard to case.
+  TfFileInfo upper = TfFileInfo();
+  upper.Version = 4;
+  upper.Path = "$/d";
+  upper.Encoding = 1200;
+  check("{\"Version\":4,\"PATH\":\"$/d\",\"ContentMetadata\":"
+      "{\"Encoding\":1200}}", upper);
+
+  if (failures != 0) {
+    fprintf(stderr, "jsonschema_test: %d failed\n", failures);
+    return 1;
+  }
+  printf("jsonschema_test: ok\n");
+  return 0;
+}
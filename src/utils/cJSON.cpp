@@ -32,7 +32,13 @@
 #include <ctype.h>
 #include "cJSON.h"
 
-static const char *ep;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CJSON_X86_SIMD
+#endif
+
+/* The parse state is per thread, documents are parsed on several at once. */
+static thread_local const char *ep;
 
 const char *cJSON_GetErrorPtr(void) {return ep;}
 
@@ -51,6 +57,47 @@ static int cJSON_strcasecmp(const char *s1, const char *s2)
 static void *(*cJSON_malloc)(size_t sz) = malloc;
 static void (*cJSON_free)(void *ptr) = free;
 
+/* Memory for cJSON_ParseInSitu, taken from blocks that are only freed with
+ * the arena. Each block is twice the size of the previous one. */
+typedef struct cJSON_ArenaBlock {struct cJSON_ArenaBlock *next; size_t size,used;} cJSON_ArenaBlock;
+struct cJSON_Arena {cJSON_ArenaBlock *blocks; size_t block_size;};
+
+static thread_local cJSON_Arena *parse_arena;	/* set while parsing in place. */
+
+cJSON_Arena *cJSON_CreateArena(size_t block_size)
+{
+	cJSON_Arena *arena=(cJSON_Arena*)cJSON_malloc(sizeof(cJSON_Arena));
+	if (!arena) return 0;
+	arena->blocks=0;
+	arena->block_size=block_size<1024?1024:block_size;
+	return arena;
+}
+
+void cJSON_DeleteArena(cJSON_Arena *arena)
+{
+	cJSON_ArenaBlock *block,*next;
+	if (!arena) return;
+	for (block=arena->blocks;block;block=next) {next=block->next;cJSON_free(block);}
+	cJSON_free(arena);
+}
+
+static void *cJSON_ArenaAlloc(cJSON_Arena *arena,size_t sz)
+{
+	cJSON_ArenaBlock *block=arena->blocks;
+	sz=(sz+7)&~(size_t)7;	/* keep everything 8 byte aligned. */
+	if (!block || block->size-block->used<sz)
+	{
+		size_t size=block?block->size*2:arena->block_size;
+		if (size<sz) size=sz;
+		block=(cJSON_ArenaBlock*)cJSON_malloc(sizeof(cJSON_ArenaBlock)+size);
+		if (!block) return 0;
+		block->size=size;block->used=0;
+		block->next=arena->blocks;arena->blocks=block;
+	}
+	block->used+=sz;
+	return (char*)(block+1)+block->used-sz;
+}
+
 static char* cJSON_strdup(const char* str)
 {
       size_t len;
@@ -77,7 +124,7 @@ void cJSON_InitHooks(cJSON_Hooks* hooks)
 /* Internal constructor. */
 static cJSON *cJSON_New_Item(void)
 {
-	cJSON* node = (cJSON*)cJSON_malloc(sizeof(cJSON));
+	cJSON* node = (cJSON*)(parse_arena?cJSON_ArenaAlloc(parse_arena,sizeof(cJSON)):cJSON_malloc(sizeof(cJSON)));
 	if (node) memset(node,0,sizeof(cJSON));
 	return node;
 }
@@ -99,11 +146,140 @@ void cJSON_Delete(cJSON *c)
 	}
 }
 
+/* End of the text being parsed (its terminating NUL), so the scanners below
+ * never read past it. */
+static thread_local const char *parse_end;
+
+/* Scanners for the parser's inner loops. Each returns the first byte in [p,end)
+ * it stops at, or end. skip_space stops at anything but whitespace (1..32),
+ * scan_string at a quote, a backslash or a control character (NUL included).
+ * SSE2 and AVX2 versions look at 16 or 32 bytes at a time; which one runs is
+ * decided once, from what the CPU supports. */
+typedef const char *(*scan_fn)(const char *p,const char *end);
+
+static const char *skip_space_scalar(const char *p,const char *end)
+{
+	while (p<end && *p && (unsigned char)*p<=32) p++;
+	return p;
+}
+
+static const char *scan_string_scalar(const char *p,const char *end)
+{
+	while (p<end && *p!='\"' && *p!='\\' && (unsigned char)*p>=32) p++;
+	return p;
+}
+
+#ifdef CJSON_X86_SIMD
+__attribute__((target("sse2")))
+static const char *skip_space_sse2(const char *p,const char *end)
+{
+	const __m128i zero=_mm_setzero_si128(),space=_mm_set1_epi8(33);
+	while (end-p>=16)
+	{
+		__m128i v=_mm_loadu_si128((const __m128i*)p);
+		/* v>=33 (unsigned) or v==0. */
+		__m128i stop=_mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v,space),v),_mm_cmpeq_epi8(v,zero));
+		int mask=_mm_movemask_epi8(stop);
+		if (mask) return p+__builtin_ctz(mask);
+		p+=16;
+	}
+	return skip_space_scalar(p,end);
+}
+
+__attribute__((target("sse2")))
+static const char *scan_string_sse2(const char *p,const char *end)
+{
+	const __m128i quote=_mm_set1_epi8('\"'),backslash=_mm_set1_epi8('\\'),control=_mm_set1_epi8(31);
+	while (end-p>=16)
+	{
+		__m128i v=_mm_loadu_si128((const __m128i*)p);
+		/* v=='"', v=='\\' or v<=31 (unsigned). */
+		__m128i stop=_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,quote),_mm_cmpeq_epi8(v,backslash)),
+			_mm_cmpeq_epi8(_mm_min_epu8(v,control),v));
+		int mask=_mm_movemask_epi8(stop);
+		if (mask) return p+__builtin_ctz(mask);
+		p+=16;
+	}
+	return scan_string_scalar(p,end);
+}
+
+__attribute__((target("avx2")))
+static const char *skip_space_avx2(const char *p,const char *end)
+{
+	const __m256i zero=_mm256_setzero_si256(),space=_mm256_set1_epi8(33);
+	while (end-p>=32)
+	{
+		__m256i v=_mm256_loadu_si256((const __m256i*)p);
+		__m256i stop=_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v,space),v),_mm256_cmpeq_epi8(v,zero));
+		unsigned mask=(unsigned)_mm256_movemask_epi8(stop);
+		if (mask) return p+__builtin_ctz(mask);
+		p+=32;
+	}
+	return skip_space_sse2(p,end);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_string_avx2(const char *p,const char *end)
+{
+	const __m256i quote=_mm256_set1_epi8('\"'),backslash=_mm256_set1_epi8('\\'),control=_mm256_set1_epi8(31);
+	while (end-p>=32)
+	{
+		__m256i v=_mm256_loadu_si256((const __m256i*)p);
+		__m256i stop=_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v,quote),_mm256_cmpeq_epi8(v,backslash)),
+			_mm256_cmpeq_epi8(_mm256_min_epu8(v,control),v));
+		unsigned mask=(unsigned)_mm256_movemask_epi8(stop);
+		if (mask) return p+__builtin_ctz(mask);
+		p+=32;
+	}
+	return scan_string_sse2(p,end);
+}
+#endif
+
+static scan_fn select_skip_space(void)
+{
+#ifdef CJSON_X86_SIMD
+	if (__builtin_cpu_supports("avx2")) return skip_space_avx2;
+	if (__builtin_cpu_supports("sse2")) return skip_space_sse2;
+#endif
+	return skip_space_scalar;
+}
+
+static scan_fn select_scan_string(void)
+{
+#ifdef CJSON_X86_SIMD
+	if (__builtin_cpu_supports("avx2")) return scan_string_avx2;
+	if (__builtin_cpu_supports("sse2")) return scan_string_sse2;
+#endif
+	return scan_string_scalar;
+}
+
+static const scan_fn skip_space=select_skip_space();
+static const scan_fn scan_string=select_scan_string();
+
 /* Parse the input text to generate a number, and populate the result into item. */
 static const char *parse_number(cJSON *item,const char *num)
 {
+	const char *start=num,*digits;
+	long long whole=0;
 	double n=0,sign=1,scale=0;int subscale=0,signsubscale=1;
 
+	/* Integers (ids, versions, sizes) are the common case: up to 18 digits
+	 * fit a long long exactly. */
+	digits=num+(*num=='-');
+	if (*digits>='0' && *digits<='9')
+	{
+		const char *p=digits;
+		while (*p>='0' && *p<='9' && p-digits<18) whole=whole*10+(*p++ -'0');
+		if (!(*p>='0' && *p<='9') && *p!='.' && *p!='e' && *p!='E' && (*digits!='0' || p==digits+1))
+		{
+			if (*num=='-') whole=-whole;
+			item->valuedouble=(double)whole;
+			item->valueint=(int)whole;
+			item->type=cJSON_Number;
+			return p;
+		}
+	}
+
 	if (*num=='-') sign=-1,num++;	/* Has sign? */
 	if (*num=='0') num++;			/* is zero */
 	if (*num>='1' && *num<='9')	do	n=(n*10.0)+(*num++ -'0');	while (*num>='0' && *num<='9');	/* Number? */
@@ -113,7 +289,15 @@ static const char *parse_number(cJSON *item,const char *num)
 		while (*num>='0' && *num<='9') subscale=(subscale*10)+(*num++ - '0');	/* Number? */
 	}
 
-	n=sign*n*pow(10.0,(scale+subscale*signsubscale));	/* number = +/- number.fraction * 10^+/- exponent */
+	/* Let strtod round the rest correctly. The text is copied first, so that
+	 * strtod sees no more than what was accepted above. */
+	if (num-start<64)
+	{
+		char buf[64];
+		memcpy(buf,start,num-start);buf[num-start]=0;
+		n=strtod(buf,0);
+	}
+	else n=sign*n*pow(10.0,(scale+subscale*signsubscale));	/* number = +/- number.fraction * 10^+/- exponent */
 	
 	item->valuedouble=n;
 	item->valueint=(int)n;
@@ -198,18 +382,32 @@ static unsigned parse_hex4(const char *str)
 static const unsigned char firstByteMark[7] = { 0x00, 0x00, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC };
 static const char *parse_string(cJSON *item,const char *str)
 {
-	const char *ptr=str+1;char *ptr2;char *out;int len=0;unsigned uc,uc2;
+	const char *ptr=str+1,*run,*close;char *ptr2;char *out;size_t len;unsigned uc,uc2;
 	if (*str!='\"') {ep=str;return 0;}	/* not a string! */
 	
-	while (*ptr!='\"' && *ptr && ++len) if (*ptr++ == '\\') ptr++;	/* Skip escaped quotes. */
+	for (;;)	/* Find the closing quote, a run of plain characters at a time. */
+	{
+		ptr=scan_string(ptr,parse_end);
+		if (*ptr=='\\' && ptr[1]) ptr+=2;	/* Skip escaped quotes. */
+		else if (*ptr && *ptr!='\"') ptr++;	/* A control character, kept as is. */
+		else break;
+	}
+	if (*ptr!='\"') {ep=str;return 0;}	/* not terminated. */
+	close=ptr;len=close-(str+1);
 	
-	out=(char*)cJSON_malloc(len+1);	/* This is how long we need for the string, roughly. */
+	if (parse_arena) out=(char*)str+1;	/* decoded in place, it never gets longer. */
+	else out=(char*)cJSON_malloc(len+1);	/* This is how long we need for the string, at most. */
 	if (!out) return 0;
 	
 	ptr=str+1;ptr2=out;
-	while (*ptr!='\"' && *ptr)
+	while (ptr<close)
 	{
-		if (*ptr!='\\') *ptr2++=*ptr++;
+		if (*ptr!='\\')
+		{
+			run=ptr;ptr=scan_string(ptr+1,parse_end);	/* copy up to the next escape. */
+			if (ptr2!=run) memmove(ptr2,run,ptr-run);
+			ptr2+=ptr-run;
+		}
 		else
 		{
 			ptr++;
@@ -221,13 +419,14 @@ static const char *parse_string(cJSON *item,const char *str)
 				case 'r': *ptr2++='\r';	break;
 				case 't': *ptr2++='\t';	break;
 				case 'u':	 /* transcode utf16 to utf8. */
+					if (close-ptr<5) {ptr=close;continue;}	/* cut short. */
 					uc=parse_hex4(ptr+1);ptr+=4;	/* get the unicode char. */
 
 					if ((uc>=0xDC00 && uc<=0xDFFF) || uc==0)	break;	/* check for invalid.	*/
 
 					if (uc>=0xD800 && uc<=0xDBFF)	/* UTF16 surrogate pairs.	*/
 					{
-						if (ptr[1]!='\\' || ptr[2]!='u')	break;	/* missing second-half of surrogate.	*/
+						if (close-ptr<7 || ptr[1]!='\\' || ptr[2]!='u')	break;	/* missing second-half of surrogate.	*/
 						uc2=parse_hex4(ptr+3);ptr+=6;
 						if (uc2<0xDC00 || uc2>0xDFFF)		break;	/* invalid second-half of surrogate.	*/
 						uc=0x10000 + (((uc&0x3FF)<<10) | (uc2&0x3FF));
@@ -248,11 +447,10 @@ static const char *parse_string(cJSON *item,const char *str)
 			ptr++;
 		}
 	}
-	*ptr2=0;
-	if (*ptr=='\"') ptr++;
+	*ptr2=0;	/* in place, this may be where the closing quote was. */
 	item->valuestring=out;
 	item->type=cJSON_String;
-	return ptr;
+	return close+1;
 }
 
 /* Render the cstring provided to an escaped version that can be printed. */
@@ -324,7 +522,11 @@ static const char *parse_object(cJSON *item,const char *value);
 static char *print_object(cJSON *item,int depth,int fmt,printbuffer *p);
 
 /* Utility to jump whitespace and cr/lf */
-static const char *skip(const char *in) {while (in && *in && (unsigned char)*in<=32) in++; return in;}
+static const char *skip(const char *in)
+{
+	if (!in || (unsigned char)*in>32) return in;	/* most of the time. */
+	return skip_space(in,parse_end);
+}
 
 /* Parse an object - create a new root, and populate. */
 cJSON *cJSON_ParseWithOpts(const char *value,const char **return_parse_end,int require_null_terminated)
@@ -333,6 +535,7 @@ cJSON *cJSON_ParseWithOpts(const char *value,const char **return_parse_end,int r
 	cJSON *c=cJSON_New_Item();
 	ep=0;
 	if (!c) return 0;       /* memory fail */
+	parse_end=value+strlen(value);
 
 	end=parse_value(c,skip(value));
 	if (!end)	{cJSON_Delete(c);return 0;}	/* parse failure. ep is set. */
@@ -342,6 +545,20 @@ cJSON *cJSON_ParseWithOpts(const char *value,const char **return_parse_end,int r
 	if (return_parse_end) *return_parse_end=end;
 	return c;
 }
+
+cJSON *cJSON_ParseInSitu(char *value,cJSON_Arena *arena)
+{
+	const char *end=0;
+	cJSON *c;
+	parse_arena=arena;
+	parse_end=value+strlen(value);
+	ep=0;
+	c=cJSON_New_Item();
+	if (c) end=parse_value(c,skip(value));
+	parse_arena=0;
+	return end?c:0;	/* on failure the nodes stay in the arena. */
+}
+
 /* Default options for cJSON_Parse */
 cJSON *cJSON_Parse(const char *value) {return cJSON_ParseWithOpts(value,0,0);}
 
@@ -364,13 +581,14 @@ char *cJSON_PrintBuffered(cJSON *item,int prebuffer,int fmt)
 static const char *parse_value(cJSON *item,const char *value)
 {
 	if (!value)						return 0;	/* Fail on null. */
-	if (!strncmp(value,"null",4))	{ item->type=cJSON_NULL;  return value+4; }
-	if (!strncmp(value,"false",5))	{ item->type=cJSON_False; return value+5; }
-	if (!strncmp(value,"true",4))	{ item->type=cJSON_True; item->valueint=1;	return value+4; }
+	/* The first character tells them apart, strings and numbers first. */
 	if (*value=='\"')				{ return parse_string(item,value); }
 	if (*value=='-' || (*value>='0' && *value<='9'))	{ return parse_number(item,value); }
-	if (*value=='[')				{ return parse_array(item,value); }
 	if (*value=='{')				{ return parse_object(item,value); }
+	if (*value=='[')				{ return parse_array(item,value); }
+	if (!strncmp(value,"null",4))	{ item->type=cJSON_NULL;  return value+4; }
+	if (!strncmp(value,"false",5))	{ item->type=cJSON_False; return value+5; }
+	if (!strncmp(value,"true",4))	{ item->type=cJSON_True; item->valueint=1;	return value+4; }
 
 	ep=value;return 0;	/* failure. */
 }
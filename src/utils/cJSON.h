@@ -125,6 +125,15 @@ extern cJSON *cJSON_Duplicate(cJSON *item,int recurse);
 need to be released. With recurse!=0, it will duplicate any children connected to the item.
 The item->next and ->prev pointers are always zero on return from Duplicate. */
 
+/* Arena for cJSON_ParseInSitu. Deleting it releases every tree parsed into it at once. */
+typedef struct cJSON_Arena cJSON_Arena;
+extern cJSON_Arena *cJSON_CreateArena(size_t block_size);
+extern void cJSON_DeleteArena(cJSON_Arena *arena);
+
+/* Parse value in place: strings are decoded into value itself (which is modified) and the nodes come from arena, so
+ * nothing is allocated per item. The tree lives as long as both value and arena do. Never cJSON_Delete it. */
+extern cJSON *cJSON_ParseInSitu(char *value,cJSON_Arena *arena);
+
 /* ParseWithOpts allows you to require (and check) that the JSON is null terminated, and to retrieve the pointer to the final byte parsed. */
 extern cJSON *cJSON_ParseWithOpts(const char *value,const char **return_parse_end,int require_null_terminated);
 
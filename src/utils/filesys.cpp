@@ -53,7 +53,7 @@ std::string get_config_path(const char *fname)
   return home_path + fname;
 }
 
-void create_dir_then_change(const std::string& dir)
+void create_dir(const std::string& dir)
 {
   int rc = access(dir.c_str(), 6);
   if (rc == -1 && errno == ENOENT) {
@@ -63,9 +63,23 @@ void create_dir_then_change(const std::string& dir)
     mkdir(dir.c_str(), 0700);
 #endif
   }
+}
+
+void create_dir_then_change(const std::string& dir)
+{
+  create_dir(dir);
   chdir(dir.c_str());
 }
 
+std::string join_path(const std::string& dir, const std::string& name)
+{
+  if (dir.empty())
+    return name;
+  if (dir.back() == PATH_SEPERATOR)
+    return dir + name;
+  return dir + PATH_SEPERATOR + name;
+}
+
 void go_up()
 {
   chdir("..");
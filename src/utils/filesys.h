@@ -29,7 +29,9 @@ namespace filesys {
 std::string get_home_directory();
 std::string get_config_path(const char *fname);
 
+void create_dir(const std::string& dir);
 void create_dir_then_change(const std::string& dir);
+std::string join_path(const std::string& dir, const std::string& name);
 void go_up();
 
 }
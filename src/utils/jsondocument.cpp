@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2017 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include "utils/jsondocument.h"
+
+namespace utils {
+
+// Most responses are a few kilobytes, listings can be many megabytes.
+static const size_t first_block = 64 * 1024;
+
+JsonDocument::JsonDocument() : m_arena(NULL), m_root(NULL)
+{
+}
+
+JsonDocument::~JsonDocument()
+{
+  clear();
+}
+
+void JsonDocument::clear()
+{
+  cJSON_DeleteArena(m_arena);
+  m_arena = NULL;
+  m_root = NULL;
+  m_text.clear();
+}
+
+cJSON *JsonDocument::parse(std::string &text)
+{
+  clear();
+  m_text.swap(text);
+
+  // Start small, the arena doubles its blocks as the tree grows, so even a
+  // large listing only takes a handful of them.
+  m_arena = cJSON_CreateArena(std::min(m_text.size(), first_block));
+  if (m_arena == NULL)
+    return NULL;
+
+  m_root = cJSON_ParseInSitu(&m_text[0], m_arena);
+  return m_root;
+}
+
+} // namespace utils
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2017 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __UTILS_JSONDOCUMENT_H__
+#define __UTILS_JSONDOCUMENT_H__
+
+#include <string>
+
+#include "utils/cJSON.h"
+
+namespace utils {
+
+// A parsed response. The document keeps the text and parses it in place,
+// with every node taken from one arena: nothing is allocated per value, and
+// the whole tree is released at once with the document.
+class JsonDocument {
+public:
+  JsonDocument();
+  ~JsonDocument();
+
+  // Parse text, which the document takes over (text is left empty). Returns
+  // the root, NULL if text is not JSON. A document can be parsed into again,
+  // which releases the previous tree.
+  cJSON *parse(std::string &text);
+
+  cJSON *root() const { return m_root; }
+
+private:
+  JsonDocument(const JsonDocument &); // avoid copy constructor
+
+  void clear();
+
+  std::string m_text;
+  cJSON_Arena *m_arena;
+  cJSON *m_root;
+};
+
+} // namespace utils
+
+#endif /* __UTILS_JSONDOCUMENT_H__ */
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2017 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstdlib>
+#include <cstring>
+
+#include "utils/jsonreader.h"
+
+namespace utils {
+
+static bool is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int hex_value(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+JsonReader::JsonReader(JsonHandler &handler) : m_handler(handler)
+{
+  reset();
+}
+
+void JsonReader::reset()
+{
+  m_state = VALUE;
+  m_stack.clear();
+  m_token.clear();
+  m_is_key = false;
+  m_unicode = 0;
+  m_unicode_digits = 0;
+  m_high_surrogate = 0;
+}
+
+bool JsonReader::feed(const char *data, size_t len)
+{
+  const char *p = data;
+  const char *end = data + len;
+
+  while (p < end && m_state != FAILED) {
+    if (m_state == STRING) {
+      // Copy the plain run up to the next quote or backslash at once.
+      const char *run = p;
+      while (p < end && *p != '"' && *p != '\\' &&
+          (unsigned char)*p >= 0x20)
+        p++;
+      m_token.append(run, p - run);
+      if (p == end)
+        break;
+    }
+
+    // Steps that do not consume the character leave p alone.
+    if (step(*p))
+      p++;
+  }
+  return m_state != FAILED;
+}
+
+bool JsonReader::finish()
+{
+  if (m_state == NUMBER && m_stack.empty())
+    end_number();
+  else if (m_state == LITERAL && m_stack.empty())
+    end_literal();
+  return m_state == DONE;
+}
+
+// Handles c in the current state. Returns whether c was consumed.
+bool JsonReader::step(char c)
+{
+  switch (m_state) {
+  case VALUE:
+    if (is_space(c))
+      return true;
+    if (!start_value(c))
+      m_state = FAILED;
+    return true;
+
+  case VALUE_OR_END:
+    if (is_space(c))
+      return true;
+    if (c == ']')
+      end_container(c);
+    else if (!start_value(c))
+      m_state = FAILED;
+    return true;
+
+  case KEY:
+  case KEY_OR_END:
+    if (is_space(c))
+      return true;
+    if (c == '"') {
+      m_is_key = true;
+      m_token.clear();
+      m_state = STRING;
+    } else if (c == '}' && m_state == KEY_OR_END) {
+      end_container(c);
+    } else {
+      m_state = FAILED;
+    }
+    return true;
+
+  case COLON:
+    if (is_space(c))
+      return true;
+    m_state = c == ':' ? VALUE : FAILED;
+    return true;
+
+  case COMMA_OR_END:
+    if (is_space(c))
+      return true;
+    if (c == ',')
+      m_state = m_stack.back() == '{' ? KEY : VALUE;
+    else if (!end_container(c))
+      m_state = FAILED;
+    return true;
+
+  case STRING:
+    if (c == '\\') {
+      m_state = ESCAPE;
+    } else if (c == '"') {
+      if (m_is_key) {
+        m_handler.key(m_token);
+        m_state = COLON;
+      } else {
+        m_handler.string(m_token);
+        value_done();
+      }
+    } else {
+      m_state = FAILED;  // unescaped control character.
+    }
+    return true;
+
+  case ESCAPE:
+    m_state = STRING;
+    switch (c) {
+    case '"': m_token += '"'; break;
+    case '\\': m_token += '\\'; break;
+    case '/': m_token += '/'; break;
+    case 'b': m_token += '\b'; break;
+    case 'f': m_token += '\f'; break;
+    case 'n': m_token += '\n'; break;
+    case 'r': m_token += '\r'; break;
+    case 't': m_token += '\t'; break;
+    case 'u':
+      m_unicode = 0;
+      m_unicode_digits = 0;
+      m_state = UNICODE;
+      break;
+    default:
+      m_state = FAILED;
+    }
+    return true;
+
+  case UNICODE: {
+    int digit = hex_value(c);
+    if (digit < 0) {
+      m_state = FAILED;
+      return true;
+    }
+    m_unicode = m_unicode * 16 + digit;
+    if (++m_unicode_digits == 4) {
+      append_code_point(m_unicode);
+      m_state = STRING;
+    }
+    return true;
+  }
+
+  case NUMBER:
+    if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+        c == 'e' || c == 'E') {
+      m_token += c;
+      return true;
+    }
+    end_number();
+    return false;
+
+  case LITERAL:
+    if (c >= 'a' && c <= 'z') {
+      m_token += c;
+      return true;
+    }
+    end_literal();
+    return false;
+
+  case DONE:
+    if (!is_space(c))
+      m_state = FAILED;
+    return true;
+
+  case FAILED:
+    break;
+  }
+  return true;
+}
+
+bool JsonReader::start_value(char c)
+{
+  if (c == '{' || c == '[') {
+    m_stack.push_back(c);
+    if (c == '{') {
+      m_handler.begin_object();
+      m_state = KEY_OR_END;
+    } else {
+      m_handler.begin_array();
+      m_state = VALUE_OR_END;
+    }
+  } else if (c == '"') {
+    m_is_key = false;
+    m_token.clear();
+    m_state = STRING;
+  } else if (c == '-' || (c >= '0' && c <= '9')) {
+    m_token.assign(1, c);
+    m_state = NUMBER;
+  } else if (c == 't' || c == 'f' || c == 'n') {
+    m_token.assign(1, c);
+    m_state = LITERAL;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// A value is complete, see what may follow it.
+void JsonReader::value_done()
+{
+  m_state = m_stack.empty() ? DONE : COMMA_OR_END;
+}
+
+bool JsonReader::end_container(char c)
+{
+  if (m_stack.empty() || (c == '}' && m_stack.back() != '{') ||
+      (c == ']' && m_stack.back() != '[') || (c != '}' && c != ']'))
+    return false;
+
+  m_stack.pop_back();
+  if (c == '}')
+    m_handler.end_object();
+  else
+    m_handler.end_array();
+  value_done();
+  return true;
+}
+
+bool JsonReader::end_number()
+{
+  char *end;
+  double value = strtod(m_token.c_str(), &end);
+  if (end != m_token.c_str() + m_token.size()) {
+    m_state = FAILED;
+    return false;
+  }
+  m_handler.number(value);
+  value_done();
+  return true;
+}
+
+bool JsonReader::end_literal()
+{
+  if (m_token == "true") {
+    m_handler.boolean(true);
+  } else if (m_token == "false") {
+    m_handler.boolean(false);
+  } else if (m_token == "null") {
+    m_handler.null();
+  } else {
+    m_state = FAILED;
+    return false;
+  }
+  value_done();
+  return true;
+}
+
+// Append a \u escape as UTF-8, pairing up UTF-16 surrogates.
+void JsonReader::append_code_point(unsigned long cp)
+{
+  if (cp >= 0xD800 && cp <= 0xDBFF) {
+    m_high_surrogate = cp;
+    return;
+  }
+  if (cp >= 0xDC00 && cp <= 0xDFFF && m_high_surrogate != 0)
+    cp = 0x10000 + ((m_high_surrogate - 0xD800) << 10) + (cp - 0xDC00);
+  m_high_surrogate = 0;
+
+  if (cp < 0x80) {
+    m_token += (char)cp;
+  } else if (cp < 0x800) {
+    m_token += (char)(0xC0 | (cp >> 6));
+    m_token += (char)(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    m_token += (char)(0xE0 | (cp >> 12));
+    m_token += (char)(0x80 | ((cp >> 6) & 0x3F));
+    m_token += (char)(0x80 | (cp & 0x3F));
+  } else {
+    m_token += (char)(0xF0 | (cp >> 18));
+    m_token += (char)(0x80 | ((cp >> 12) & 0x3F));
+    m_token += (char)(0x80 | ((cp >> 6) & 0x3F));
+    m_token += (char)(0x80 | (cp & 0x3F));
+  }
+}
+
+} // namespace utils
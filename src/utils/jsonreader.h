@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2017 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __UTILS_JSONREADER_H__
+#define __UTILS_JSONREADER_H__
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace utils {
+
+// Receives the parts of a JSON document in order, as JsonReader comes
+// across them.
+class JsonHandler {
+public:
+  virtual ~JsonHandler() {}
+
+  virtual void begin_object() {}
+  virtual void end_object() {}
+  virtual void begin_array() {}
+  virtual void end_array() {}
+  virtual void key(const std::string &name) {}
+  virtual void string(const std::string &value) {}
+  virtual void number(double value) {}
+  virtual void boolean(bool value) {}
+  virtual void null() {}
+};
+
+// Incremental JSON parser. The document can be fed in chunks of any size,
+// split anywhere, and the handler hears about every value as soon as its
+// last byte arrives. Only the value being read is buffered, never the
+// document.
+class JsonReader {
+public:
+  explicit JsonReader(JsonHandler &handler);
+
+  // Returns false once the input turned out not to be JSON.
+  bool feed(const char *data, size_t len);
+
+  // End of input. Returns whether it held exactly one complete document.
+  bool finish();
+
+  // Forget everything fed so far.
+  void reset();
+
+  bool failed() const { return m_state == FAILED; }
+
+private:
+  enum state {
+    VALUE,          // any value.
+    VALUE_OR_END,   // after '[': a value or ']'.
+    KEY,            // after ',' in an object.
+    KEY_OR_END,     // after '{': a key or '}'.
+    COLON,
+    COMMA_OR_END,   // after a value in an object or array.
+    STRING,
+    ESCAPE,         // after a backslash in a string.
+    UNICODE,        // the hex digits of \uXXXX.
+    NUMBER,
+    LITERAL,        // true, false or null.
+    DONE,
+    FAILED
+  };
+
+  bool step(char c);
+  bool start_value(char c);
+  void value_done();
+  bool end_container(char c);
+  bool end_number();
+  bool end_literal();
+  void append_code_point(unsigned long cp);
+
+  JsonHandler &m_handler;
+  state m_state;
+  std::vector<char> m_stack;  // '{' or '[' of each open container.
+  std::string m_token;        // string, number or literal being read.
+  bool m_is_key;              // the string being read is a key.
+  unsigned long m_unicode;    // \u escape being read.
+  int m_unicode_digits;
+  unsigned long m_high_surrogate;
+};
+
+} // namespace utils
+
+#endif /* __UTILS_JSONREADER_H__ */
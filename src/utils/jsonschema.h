@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2017 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __UTILS_JSONSCHEMA_H__
+#define __UTILS_JSONSCHEMA_H__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "utils/cJSON.h"
+
+namespace utils {
+
+// Decoding JSON objects straight into structs, driven by a table that says
+// where each member goes:
+//
+//   static const JsonField<Item> item_fields[] = {
+//     { "path", SetString<Item, &Item::Path>, NULL },
+//     { "owner", NULL, &owner_schema },  // members stored into Item too.
+//   };
+//   static const JsonSchema<Item> item_schema = MakeSchema(item_fields);
+//
+// The members of an object are visited once, in document order, and each
+// one is looked up in the table, which MakeSchema sorts by name, with a
+// binary search that ignores case. Unknown members are skipped.
+
+// A scalar member as handed to a setter.
+struct JsonScalar {
+  int type;            // cJSON_Number, cJSON_String, cJSON_True, ...
+  const char *string;  // for cJSON_String.
+  double number;       // for cJSON_Number.
+};
+
+template <class T> class JsonSchema;
+
+// One member: either set stores a scalar, or object names the schema of
+// a nested object, whose members are stored into the same T.
+template <class T>
+struct JsonField {
+  const char *name;
+  void (*set)(T &obj, const JsonScalar &value);
+  const JsonSchema<T> *object;
+};
+
+// Orders member names like strcmp, but without regard to (ASCII) case.
+inline int CompareNames(const char *a, const char *b)
+{
+  for (;; a++, b++) {
+    int ca = (unsigned char)*a, cb = (unsigned char)*b;
+    if (ca >= 'A' && ca <= 'Z')
+      ca += 'a' - 'A';
+    if (cb >= 'A' && cb <= 'Z')
+      cb += 'a' - 'A';
+    if (ca != cb || ca == 0)
+      return ca - cb;
+  }
+}
+
+template <class T>
+class JsonSchema {
+public:
+  JsonSchema(const JsonField<T> *fields, size_t count) : m_sorted(count)
+  {
+    for (size_t i = 0; i < count; i++)
+      m_sorted[i] = &fields[i];
+    std::sort(m_sorted.begin(), m_sorted.end(),
+        [](const JsonField<T> *a, const JsonField<T> *b) {
+      return CompareNames(a->name, b->name) < 0;
+    });
+  }
+
+  // Names match without regard to case, like cJSON_GetObjectItem.
+  const JsonField<T> *find(const char *name) const
+  {
+    auto it = std::lower_bound(m_sorted.begin(), m_sorted.end(), name,
+        [](const JsonField<T> *field, const char *key) {
+      return CompareNames(field->name, key) < 0;
+    });
+    if (it == m_sorted.end() || CompareNames((*it)->name, name) != 0)
+      return NULL;
+    return *it;
+  }
+
+private:
+  std::vector<const JsonField<T> *> m_sorted;
+};
+
+template <class T, size_t N>
+JsonSchema<T> MakeSchema(const JsonField<T> (&fields)[N])
+{
+  return JsonSchema<T>(fields, N);
+}
+
+// Setters for the common member types. Values of another JSON type leave
+// the member alone.
+template <class T, int T::*M>
+void SetInt(T &obj, const JsonScalar &value)
+{
+  if (value.type == cJSON_Number)
+    obj.*M = (int)value.number;
+}
+
+template <class T, int64_t T::*M>
+void SetInt64(T &obj, const JsonScalar &value)
+{
+  if (value.type == cJSON_Number)
+    obj.*M = (int64_t)value.number;
+}
+
+template <class T, bool T::*M>
+void SetBool(T &obj, const JsonScalar &value)
+{
+  if (value.type == cJSON_True || value.type == cJSON_False)
+    obj.*M = value.type == cJSON_True;
+}
+
+template <class T, std::string T::*M>
+void SetString(T &obj, const JsonScalar &value)
+{
+  if (value.type == cJSON_String)
+    obj.*M = value.string;
+}
+
+// Decode the members of a parsed object into obj.
+template <class T>
+void DecodeObject(const JsonSchema<T> &schema, const cJSON *object, T &obj)
+{
+  if (object == NULL || object->type != cJSON_Object)
+    return;
+
+  for (const cJSON *member = object->child; member != NULL;
+      member = member->next) {
+    const JsonField<T> *field = schema.find(member->string);
+    if (field == NULL)
+      continue;
+
+    if (field->object != NULL) {
+      DecodeObject(*field->object, member, obj);
+    } else if (member->type != cJSON_Object && member->type != cJSON_Array) {
+      JsonScalar value = { member->type, member->valuestring,
+        member->valuedouble };
+      field->set(obj, value);
+    }
+  }
+}
+
+// The same for an object that arrives as JsonReader events: begin() when
+// its '{' has been read, then pass on the events up to and including its
+// '}', for which end() returns true.
+template <class T>
+class SchemaReader {
+public:
+  explicit SchemaReader(const JsonSchema<T> &schema) : m_schema(schema),
+    m_obj(NULL)
+  {
+  }
+
+  void begin(T &obj)
+  {
+    m_obj = &obj;
+    m_open.assign(1, &m_schema);
+  }
+
+  bool active() const { return !m_open.empty(); }
+
+  // Drop the object being read, if any.
+  void reset() { m_open.clear(); }
+
+  void key(const std::string &name) { m_key = name; }
+
+  void scalar(const JsonScalar &value)
+  {
+    const JsonField<T> *field = lookup();
+    if (field != NULL && field->set != NULL)
+      field->set(*m_obj, value);
+  }
+
+  // A nested object or array opens. Arrays, and objects not in the
+  // schema, are skipped along with everything in them.
+  void nest(bool object)
+  {
+    const JsonField<T> *field = object ? lookup() : NULL;
+    m_open.push_back(field != NULL ? field->object : NULL);
+  }
+
+  // Returns true once the object passed to begin() is complete.
+  bool end()
+  {
+    m_open.pop_back();
+    return m_open.empty();
+  }
+
+private:
+  const JsonField<T> *lookup() const
+  {
+    const JsonSchema<T> *schema = m_open.back();
+    return schema != NULL ? schema->find(m_key.c_str()) : NULL;
+  }
+
+  const JsonSchema<T> &m_schema;
+  T *m_obj;
+  std::vector<const JsonSchema<T> *> m_open; // NULL for skipped containers.
+  std::string m_key;
+};
+
+} // namespace utils
+
+#endif /* __UTILS_JSONSCHEMA_H__ */
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2017 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstdio>
+#include <cstring>
+
+#include "utils/md5.h"
+
+namespace utils {
+
+static const uint32_t sines[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+  0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+  0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+  0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+  0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+  0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+  0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+  0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+  0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const int shifts[64] = {
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+Md5::Md5() : m_length(0)
+{
+  m_state[0] = 0x67452301;
+  m_state[1] = 0xefcdab89;
+  m_state[2] = 0x98badcfe;
+  m_state[3] = 0x10325476;
+}
+
+void
+Md5::transform(const unsigned char *block)
+{
+  uint32_t words[16];
+  for (int i = 0; i < 16; i++) {
+    words[i] = (uint32_t)block[i * 4] | (uint32_t)block[i * 4 + 1] << 8 |
+      (uint32_t)block[i * 4 + 2] << 16 | (uint32_t)block[i * 4 + 3] << 24;
+  }
+
+  uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+  for (int i = 0; i < 64; i++) {
+    uint32_t f;
+    int g;
+    if (i < 16) {
+      f = (b & c) | (~b & d);
+      g = i;
+    } else if (i < 32) {
+      f = (d & b) | (~d & c);
+      g = (5 * i + 1) % 16;
+    } else if (i < 48) {
+      f = b ^ c ^ d;
+      g = (3 * i + 5) % 16;
+    } else {
+      f = c ^ (b | ~d);
+      g = (7 * i) % 16;
+    }
+    f += a + sines[i] + words[g];
+    a = d;
+    d = c;
+    c = b;
+    b += (f << shifts[i]) | (f >> (32 - shifts[i]));
+  }
+
+  m_state[0] += a;
+  m_state[1] += b;
+  m_state[2] += c;
+  m_state[3] += d;
+}
+
+void
+Md5::update(const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  size_t used = m_length % 64;
+
+  m_length += len;
+  if (used > 0) {
+    size_t take = len < 64 - used ? len : 64 - used;
+    memcpy(m_buffer + used, p, take);
+    p += take;
+    len -= take;
+    if (used + take < 64)
+      return;
+    transform(m_buffer);
+  }
+
+  for (; len >= 64; p += 64, len -= 64)
+    transform(p);
+  memcpy(m_buffer, p, len);
+}
+
+std::string
+Md5::digest()
+{
+  uint64_t bits = m_length * 8;
+  unsigned char pad[72] = { 0x80 };
+  size_t used = m_length % 64;
+  size_t pad_len = (used < 56 ? 56 : 120) - used;
+
+  for (int i = 0; i < 8; i++)
+    pad[pad_len + i] = (unsigned char)(bits >> (8 * i));
+  update(pad, pad_len + 8);
+
+  std::string out(16, '\0');
+  for (int i = 0; i < 16; i++)
+    out[i] = (char)(m_state[i / 4] >> (8 * (i % 4)));
+  return out;
+}
+
+std::string
+Md5File(const std::string &path)
+{
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (fp == NULL)
+    return std::string();
+
+  Md5 md5;
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    md5.update(buf, n);
+
+  bool failed = ferror(fp) != 0;
+  fclose(fp);
+  return failed ? std::string() : md5.digest();
+}
+
+static int base64_value(char c)
+{
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 26;
+  if (c >= '0' && c <= '9')
+    return c - '0' + 52;
+  if (c == '+')
+    return 62;
+  if (c == '/')
+    return 63;
+  return -1;
+}
+
+std::string
+DecodeMd5Hash(const std::string &hash)
+{
+  // 16 bytes take 22 characters, padded to 24 with "==".
+  if (hash.size() != 24 || hash.compare(22, 2, "==") != 0)
+    return std::string();
+
+  std::string out;
+  uint32_t bits = 0;
+  int count = 0;
+  for (size_t i = 0; i < 22; i++) {
+    int value = base64_value(hash[i]);
+    if (value < 0)
+      return std::string();
+    bits = bits << 6 | value;
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      out.push_back((char)(bits >> count));
+    }
+  }
+  return out;
+}
+
+} // namespace utils
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2017 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __UTILS_MD5_H__
+#define __UTILS_MD5_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace utils {
+
+// MD5 (RFC 1321). Only used to tell whether a local file still holds the
+// content that the server lists in the hashValue of an item.
+class Md5 {
+public:
+  Md5();
+
+  void update(const void *data, size_t len);
+
+  // The 16 byte digest. Nothing can be added afterwards.
+  std::string digest();
+
+private:
+  void transform(const unsigned char *block);
+
+  uint32_t m_state[4];
+  uint64_t m_length;           // bytes passed to update().
+  unsigned char m_buffer[64];  // the partial block, m_length % 64 bytes.
+};
+
+// Digest of the contents of the file at path, empty if it cannot be read.
+std::string Md5File(const std::string &path);
+
+// The digest in a hashValue (base64), empty if hash is not one.
+std::string DecodeMd5Hash(const std::string &hash);
+
+} // namespace utils
+
+#endif /* __UTILS_MD5_H__ */